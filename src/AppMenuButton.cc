@@ -63,6 +63,14 @@ int AppMenuButton::buttonIndex() const
     return m_buttonIndex;
 }
 
+void AppMenuButton::setButtonIndex(int set)
+{
+    if (m_buttonIndex != set) {
+        m_buttonIndex = set;
+        emit buttonIndexChanged();
+    }
+}
+
 QColor AppMenuButton::backgroundColor() const
 {
     const auto *buttonGroup = qobject_cast<AppMenuButtonGroup *>(parent());
@@ -40,6 +40,8 @@ public:
     Q_PROPERTY(int buttonIndex READ buttonIndex NOTIFY buttonIndexChanged)
 
     int buttonIndex() const;
+    //* rows before this one were inserted or removed
+    void setButtonIndex(int set);
 
     QColor backgroundColor() const override;
     QColor foregroundColor() const override;
@@ -36,6 +36,7 @@
 #include <QDebug>
 #include <QMenu>
 #include <QPainter>
+#include <QTimer>
 #include <QVariantAnimation>
 
 
@@ -53,7 +54,14 @@ AppMenuButtonGroup::AppMenuButtonGroup(Decoration *decoration)
     , m_animationEnabled(false)
     , m_animation(new QVariantAnimation(this))
     , m_opacity(1)
+    , m_menuPrefetch(decoration->menuPrefetch())
+    , m_hoverIntentTimer(new QTimer(this))
 {
+    m_hoverIntentTimer->setSingleShot(true);
+    m_hoverIntentTimer->setInterval(150);
+    connect(m_hoverIntentTimer, &QTimer::timeout,
+            this, &AppMenuButtonGroup::onHoverIntent);
+
     // Assign showing and opacity before we bind the onShowingChanged animation
     // so that new windows do not animate.
     setAlwaysShow(decoration->menuAlwaysShow());
@@ -92,6 +100,9 @@ AppMenuButtonGroup::AppMenuButtonGroup(Decoration *decoration)
 
 AppMenuButtonGroup::~AppMenuButtonGroup()
 {
+    // The menus belong to an importer shared with other windows, which
+    // outlives this group and its model.
+    releaseMenu(m_currentMenu);
 }
 
 int AppMenuButtonGroup::currentIndex() const
@@ -212,6 +223,29 @@ void AppMenuButtonGroup::setOpacity(qreal value)
     }
 }
 
+bool AppMenuButtonGroup::menuPrefetch() const
+{
+    return m_menuPrefetch;
+}
+
+void AppMenuButtonGroup::setMenuPrefetch(bool value)
+{
+    if (m_menuPrefetch != value) {
+        m_menuPrefetch = value;
+        if (m_appMenuModel) {
+            m_appMenuModel->setPrefetchSubmenus(m_menuPrefetch);
+        }
+        emit menuPrefetchChanged(value);
+    }
+}
+
+void AppMenuButtonGroup::onHoverIntent()
+{
+    if (m_hoverIntentButton && m_hoverIntentButton->isHovered() && m_appMenuModel) {
+        m_appMenuModel->fetchSubmenu(m_hoverIntentButton->buttonIndex());
+    }
+}
+
 KDecoration2::DecorationButton* AppMenuButtonGroup::buttonAt(int x, int y) const
 {
     for (int i = 0; i < buttons().length(); i++) {
@@ -243,21 +277,27 @@ void AppMenuButtonGroup::resetButtons()
     emit menuUpdated();
 }
 
-void AppMenuButtonGroup::updateAppMenuModel()
+bool AppMenuButtonGroup::showsAppMenu() const
 {
-    auto *deco = qobject_cast<Decoration *>(decoration());
+    const auto *deco = qobject_cast<Decoration *>(decoration());
     if (!deco) {
-        return;
+        return false;
     }
-    auto *decoratedClient = deco->client().toStrongRef().data();
+    const auto *decoratedClient = deco->client().toStrongRef().data();
 
     // Don't display AppMenu in modal windows.
-    if (decoratedClient->isModal()) {
-        resetButtons();
+    return !decoratedClient->isModal() && decoratedClient->hasApplicationMenu();
+}
+
+void AppMenuButtonGroup::updateAppMenuModel()
+{
+    auto *deco = qobject_cast<Decoration *>(decoration());
+    if (!deco) {
         return;
     }
+    auto *decoratedClient = deco->client().toStrongRef().data();
 
-    if (!decoratedClient->hasApplicationMenu()) {
+    if (!showsAppMenu()) {
         resetButtons();
         return;
     }
@@ -270,27 +310,7 @@ void AppMenuButtonGroup::updateAppMenuModel()
 
         // Populate
         for (int row = 0; row < m_appMenuModel->rowCount(); row++) {
-            const QModelIndex index = m_appMenuModel->index(row, 0);
-            const QString itemLabel = m_appMenuModel->data(index, AppMenuModel::MenuRole).toString();
-
-            // https://github.com/psifidotos/applet-window-appmenu/blob/908e60831d7d68ee56a56f9c24017a71822fc02d/lib/appmenuapplet.cpp#L167
-            const QVariant data = m_appMenuModel->data(index, AppMenuModel::ActionRole);
-            QAction *itemAction = (QAction *)data.value<void *>();
-
-            // qCDebug(category) << "    " << itemAction;
-
-            TextButton *b = new TextButton(deco, row, this);
-            b->setText(itemLabel);
-            b->setAction(itemAction);
-            b->setOpacity(m_opacity);
-
-            // Skip items with empty labels (The first item in a Gtk app)
-            if (itemLabel.isEmpty()) {
-                b->setEnabled(false);
-                b->setVisible(false);
-            }
-            
-            addButton(QPointer<KDecoration2::DecorationButton>(b));
+            addButton(QPointer<KDecoration2::DecorationButton>(createTextButton(row)));
         }
         m_overflowIndex = m_appMenuModel->rowCount();
         addButton(new MenuOverflowButton(deco, m_overflowIndex, this));
@@ -303,8 +323,15 @@ void AppMenuButtonGroup::updateAppMenuModel()
         WId windowId = decoratedClient->windowId();
         if (windowId != 0) {
             m_appMenuModel = new AppMenuModel(this);
+            m_appMenuModel->setPrefetchSubmenus(m_menuPrefetch);
             connect(m_appMenuModel, &AppMenuModel::modelReset,
                 this, &AppMenuButtonGroup::updateAppMenuModel);
+            connect(m_appMenuModel, &AppMenuModel::rowsInserted,
+                this, &AppMenuButtonGroup::onRowsInserted);
+            connect(m_appMenuModel, &AppMenuModel::rowsRemoved,
+                this, &AppMenuButtonGroup::onRowsRemoved);
+            connect(m_appMenuModel, &AppMenuModel::dataChanged,
+                this, &AppMenuButtonGroup::onDataChanged);
 
             // qCDebug(category) << "AppMenuModel" << m_appMenuModel;
             m_appMenuModel->setWinId(windowId);
@@ -313,6 +340,145 @@ void AppMenuButtonGroup::updateAppMenuModel()
     }
 }
 
+TextButton *AppMenuButtonGroup::createTextButton(int row)
+{
+    auto *deco = qobject_cast<Decoration *>(decoration());
+
+    TextButton *b = new TextButton(deco, row, this);
+    b->setOpacity(m_opacity);
+    updateTextButton(b, row);
+
+    connect(b, &KDecoration2::DecorationButton::hoveredChanged,
+            this, [this, b](bool hovered) {
+                if (hovered) {
+                    m_hoverIntentButton = b;
+                    m_hoverIntentTimer->start();
+                }
+            });
+
+    return b;
+}
+
+void AppMenuButtonGroup::updateTextButton(TextButton *button, int row)
+{
+    const QModelIndex index = m_appMenuModel->index(row, 0);
+    const QString itemLabel = m_appMenuModel->data(index, AppMenuModel::MenuRole).toString();
+
+    // https://github.com/psifidotos/applet-window-appmenu/blob/908e60831d7d68ee56a56f9c24017a71822fc02d/lib/appmenuapplet.cpp#L167
+    const QVariant data = m_appMenuModel->data(index, AppMenuModel::ActionRole);
+    QAction *itemAction = (QAction *)data.value<void *>();
+
+    // qCDebug(category) << "    " << itemAction;
+
+    button->setText(itemLabel);
+    button->setAction(itemAction);
+
+    // Skip items with empty labels (The first item in a Gtk app)
+    if (itemLabel.isEmpty()) {
+        button->setEnabled(false);
+        button->setVisible(false);
+    } else if (!button->isEnabled()) {
+        // updateOverflow() hides it again if it doesn't fit
+        button->setEnabled(true);
+        button->setVisible(true);
+    }
+}
+
+void AppMenuButtonGroup::insertButtons(int index, const QVector<KDecoration2::DecorationButton *> &newButtons)
+{
+    const auto tail = buttons().mid(index);
+    for (const auto &button : tail) {
+        removeButton(button);
+    }
+    for (KDecoration2::DecorationButton *button : newButtons) {
+        addButton(QPointer<KDecoration2::DecorationButton>(button));
+    }
+    for (const auto &button : tail) {
+        addButton(button);
+    }
+}
+
+void AppMenuButtonGroup::updateButtonIndexes(int index)
+{
+    const auto list = buttons();
+    for (int i = index; i < list.length(); i++) {
+        auto *button = qobject_cast<AppMenuButton *>(list.at(i));
+        if (button) {
+            button->setButtonIndex(i);
+        }
+    }
+    m_overflowIndex = m_appMenuModel->rowCount();
+}
+
+void AppMenuButtonGroup::onRowsInserted(const QModelIndex &parent, int first, int last)
+{
+    Q_UNUSED(parent)
+
+    // No menu buttons yet, populate from scratch. The model inserts one
+    // row at a time, so windows that show no menu must not be reset and
+    // laid out again for each of them.
+    if (buttons().isEmpty()) {
+        if (showsAppMenu()) {
+            updateAppMenuModel();
+        }
+        return;
+    }
+
+    QVector<KDecoration2::DecorationButton *> newButtons;
+    for (int row = first; row <= last; row++) {
+        newButtons << createTextButton(row);
+    }
+    insertButtons(first, newButtons);
+    updateButtonIndexes(last + 1);
+
+    if (m_currentIndex >= first) {
+        setCurrentIndex(m_currentIndex + newButtons.length());
+    }
+
+    emit menuUpdated();
+}
+
+void AppMenuButtonGroup::onRowsRemoved(const QModelIndex &parent, int first, int last)
+{
+    Q_UNUSED(parent)
+
+    if (buttons().isEmpty()) {
+        return;
+    }
+
+    const auto removed = buttons().mid(first, last - first + 1);
+    for (const auto &button : removed) {
+        removeButton(button);
+        delete button;
+    }
+    updateButtonIndexes(first);
+
+    if (m_currentIndex > last) {
+        setCurrentIndex(m_currentIndex - removed.length());
+    } else if (m_currentIndex >= first) {
+        setCurrentIndex(-1);
+    }
+
+    emit menuUpdated();
+}
+
+void AppMenuButtonGroup::onDataChanged(const QModelIndex &topLeft, const QModelIndex &bottomRight)
+{
+    const auto list = buttons();
+    bool changed = false;
+    for (int row = topLeft.row(); row <= bottomRight.row(); row++) {
+        auto *button = qobject_cast<TextButton *>(list.value(row));
+        if (button) {
+            updateTextButton(button, row);
+            changed = true;
+        }
+    }
+
+    if (changed) {
+        emit menuUpdated();
+    }
+}
+
 void AppMenuButtonGroup::updateOverflow(QRectF availableRect)
 {
     // qCDebug(category) << "updateOverflow" << availableRect;
@@ -424,7 +590,7 @@ void AppMenuButtonGroup::trigger(int buttonIndex) {
 
         if (oldMenu && oldMenu != actionMenu) {
             // Don't reset the currentIndex when another menu is already shown
-            disconnect(oldMenu, &QMenu::aboutToHide, this, &AppMenuButtonGroup::onMenuAboutToHide);
+            releaseMenu(oldMenu);
             oldMenu->hide();
         }
         if (0 <= m_currentIndex && m_currentIndex < buttons().length()) {
@@ -509,6 +675,17 @@ bool AppMenuButtonGroup::eventFilter(QObject *watched, QEvent *event)
     return false;
 }
 
+void AppMenuButtonGroup::releaseMenu(QMenu *menu)
+{
+    if (!menu) {
+        return;
+    }
+    // Other windows of the same application may open this menu next, so
+    // its key presses and closing must not reach this group any more.
+    menu->removeEventFilter(this);
+    disconnect(menu, &QMenu::aboutToHide, this, &AppMenuButtonGroup::onMenuAboutToHide);
+}
+
 bool AppMenuButtonGroup::isMenuOpen() const
 {
     return 0 <= m_currentIndex;
@@ -533,6 +710,16 @@ void AppMenuButtonGroup::updateShowing()
 
 void AppMenuButtonGroup::onMenuAboutToHide()
 {
+    // An open menu grabs the pointer, so the window can't move and
+    // eventFilter() reuses the cached windowPos() on every MouseMove.
+    // Once closed, the window may be moved again.
+    const auto *deco = qobject_cast<Decoration *>(decoration());
+    if (deco) {
+        deco->invalidateWindowPos();
+    }
+
+    releaseMenu(m_currentMenu);
+
     if (0 <= m_currentIndex && m_currentIndex < buttons().length()) {
         buttons().value(m_currentIndex)->setChecked(false);
     }
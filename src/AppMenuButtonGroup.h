@@ -27,12 +27,14 @@
 
 // Qt
 #include <QMenu>
+#include <QTimer>
 #include <QVariantAnimation>
 
 namespace Material
 {
 
 class Decoration;
+class TextButton;
 
 class AppMenuButtonGroup : public KDecoration2::DecorationButtonGroup
 {
@@ -50,6 +52,7 @@ public:
     Q_PROPERTY(bool animationEnabled READ animationEnabled WRITE setAnimationEnabled NOTIFY animationEnabledChanged)
     Q_PROPERTY(int animationDuration READ animationDuration WRITE setAnimationDuration NOTIFY animationDurationChanged)
     Q_PROPERTY(qreal opacity READ opacity WRITE setOpacity NOTIFY opacityChanged)
+    Q_PROPERTY(bool menuPrefetch READ menuPrefetch WRITE setMenuPrefetch NOTIFY menuPrefetchChanged)
 
     int currentIndex() const;
     void setCurrentIndex(int set);
@@ -75,6 +78,9 @@ public:
     qreal opacity() const;
     void setOpacity(qreal value);
 
+    bool menuPrefetch() const;
+    void setMenuPrefetch(bool value);
+
     bool isMenuOpen() const;
 
     KDecoration2::DecorationButton* buttonAt(int x, int y) const;
@@ -91,6 +97,10 @@ public slots:
 
 private slots:
     void onShowingChanged(bool hovered);
+    void onRowsInserted(const QModelIndex &parent, int first, int last);
+    void onRowsRemoved(const QModelIndex &parent, int first, int last);
+    void onDataChanged(const QModelIndex &topLeft, const QModelIndex &bottomRight);
+    void onHoverIntent();
 
 signals:
     void menuUpdated();
@@ -105,6 +115,7 @@ signals:
     void animationEnabledChanged(bool);
     void animationDurationChanged(int);
     void opacityChanged(qreal);
+    void menuPrefetchChanged(bool);
 
 protected:
     bool eventFilter(QObject *watched, QEvent *event) override;
@@ -112,6 +123,22 @@ protected:
 private:
     void resetButtons();
 
+    //* modal windows and windows without an app menu get no buttons
+    bool showsAppMenu() const;
+
+    //* button for the model row, which is also its index in buttons()
+    TextButton *createTextButton(int row);
+    void updateTextButton(TextButton *button, int row);
+
+    //* DecorationButtonGroup can only append, so the buttons after
+    //* @p index are taken out and added back behind @p newButtons
+    void insertButtons(int index, const QVector<KDecoration2::DecorationButton *> &newButtons);
+    //* renumber the buttons from @p index on, after rows came or went
+    void updateButtonIndexes(int index);
+
+    //* stop filtering the events of @p menu and handling its aboutToHide
+    void releaseMenu(QMenu *menu);
+
     AppMenuModel *m_appMenuModel;
     int m_currentIndex;
     int m_overflowIndex;
@@ -122,7 +149,12 @@ private:
     bool m_animationEnabled;
     QVariantAnimation *m_animation;
     qreal m_opacity;
+    bool m_menuPrefetch;
     QPointer<QMenu> m_currentMenu;
+
+    //* the submenu of a button is fetched once the pointer rests on it
+    QTimer *m_hoverIntentTimer;
+    QPointer<TextButton> m_hoverIntentButton;
 };
 
 } // namespace Material
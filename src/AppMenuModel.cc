@@ -23,14 +23,10 @@
 
 // own
 #include "AppMenuModel.h"
+#include "AppMenuWindowTracker.h"
 #include "Material.h"
 #include "BuildConfig.h"
 
-#if HAVE_X11
-#include <QX11Info>
-#include <xcb/xcb.h>
-#endif
-
 // Qt
 #include <QAction>
 #include <QDebug>
@@ -39,6 +35,7 @@
 #include <QDBusConnectionInterface>
 #include <QDBusServiceWatcher>
 #include <QGuiApplication>
+#include <QTimer>
 
 // libdbusmenuqt
 #include <dbusmenuimporter.h>
@@ -47,19 +44,26 @@
 namespace Material
 {
 
-static const QByteArray s_x11AppMenuServiceNamePropertyName = QByteArrayLiteral("_KDE_NET_WM_APPMENU_SERVICE_NAME");
-static const QByteArray s_x11AppMenuObjectPathPropertyName = QByteArrayLiteral("_KDE_NET_WM_APPMENU_OBJECT_PATH");
-
-#if HAVE_X11
-static QHash<QByteArray, xcb_atom_t> s_atoms;
-#endif
+//! how many submenus are fetched in the background at the same time
+static const int s_maxConcurrentPrefetches = 2;
+//! how long the window must be left alone before prefetching starts
+static const int s_prefetchDelay = 500;
+//! How many menu levels a GetLayout call fetches. Without prefetching,
+//! submenus are only fetched on hover or when opened, so activating a window
+//! must not pay for all of them. With it, the menu bar and its menus come
+//! with one reply instead of one per menu. The importer still falls back to
+//! one level for menus with more than 500 items.
+static int menuLayoutDepth(bool prefetchSubmenus)
+{
+    return prefetchSubmenus ? 2 : 1;
+}
 
 class KDBusMenuImporter : public DBusMenuImporter
 {
 
 public:
-    KDBusMenuImporter(const QString &service, const QString &path, QObject *parent)
-        : DBusMenuImporter(service, path, parent) {
+    KDBusMenuImporter(const QString &service, const QString &path, int layoutDepth, QObject *parent)
+        : DBusMenuImporter(service, path, layoutDepth, parent) {
 
     }
 
@@ -70,10 +74,97 @@ protected:
 
 };
 
+//! Windows of the same application often export the same menu, so every
+//! model showing it shares one importer and one QMenu tree.
+struct SharedImporter
+{
+    KDBusMenuImporter *importer;
+    int refCount;
+    //! an updateMenu() is queued or waiting for its menuUpdated()
+    bool fetchPending;
+};
+
+typedef QPair<QString, QString> ImporterKey;
+static QHash<ImporterKey, SharedImporter> s_importers;
+
+//! parent of the shared importers, deleted with the last decoration
+static QObject *s_importerOwner = nullptr;
+
+//! @p shared is set when another model already uses the importer
+static KDBusMenuImporter *acquireImporter(const QString &serviceName, const QString &menuObjectPath, int layoutDepth, bool *shared)
+{
+    const ImporterKey key(serviceName, menuObjectPath);
+    auto it = s_importers.find(key);
+
+    if (it != s_importers.end()) {
+        ++it->refCount;
+        *shared = true;
+        return it->importer;
+    }
+
+    if (!s_importerOwner) {
+        s_importerOwner = new QObject();
+    }
+
+    auto *importer = new KDBusMenuImporter(serviceName, menuObjectPath, layoutDepth, s_importerOwner);
+    s_importers.insert(key, { importer, 1, false });
+    *shared = false;
+
+    QObject::connect(importer, &DBusMenuImporter::menuUpdated, s_importerOwner, [key, importer](QMenu *menu) {
+        auto it = s_importers.find(key);
+        if (it != s_importers.end() && menu == importer->menu()) {
+            it->fetchPending = false;
+        }
+    });
+
+    return importer;
+}
+
+//! Models sharing an importer would each ask for the same menu bar, so
+//! only the first request of a fetch reaches the application.
+static void requestMenuUpdate(KDBusMenuImporter *importer)
+{
+    for (auto it = s_importers.begin(); it != s_importers.end(); ++it) {
+        if (it->importer == importer) {
+            if (!it->fetchPending) {
+                it->fetchPending = true;
+                QMetaObject::invokeMethod(importer, "updateMenu", Qt::QueuedConnection);
+            }
+            return;
+        }
+    }
+}
+
+static void releaseImporter(KDBusMenuImporter *importer)
+{
+    for (auto it = s_importers.begin(); it != s_importers.end(); ++it) {
+        if (it->importer == importer) {
+            if (--it->refCount == 0) {
+                importer->deleteLater();
+                s_importers.erase(it);
+            }
+            return;
+        }
+    }
+}
+
+void AppMenuModel::releaseSharedImporters()
+{
+    // Models still holding an importer see their QPointer cleared.
+    s_importers.clear();
+    delete s_importerOwner;
+    s_importerOwner = nullptr;
+}
+
 AppMenuModel::AppMenuModel(QObject *parent)
     : QAbstractListModel(parent),
-      m_serviceWatcher(new QDBusServiceWatcher(this))
+      m_serviceWatcher(new QDBusServiceWatcher(this)),
+      m_prefetchTimer(new QTimer(this))
 {
+    m_prefetchTimer->setSingleShot(true);
+    m_prefetchTimer->setInterval(s_prefetchDelay);
+    connect(m_prefetchTimer, &QTimer::timeout, this, &AppMenuModel::processPrefetchQueue);
+
     if (!KWindowSystem::isPlatformX11()) {
         return;
     }
@@ -82,15 +173,8 @@ AppMenuModel::AppMenuModel(QObject *parent)
         onActiveWindowChanged(m_winId.toUInt());
     });
 
-    // connect(KWindowSystem::self(), &KWindowSystem::activeWindowChanged, this, &AppMenuModel::onActiveWindowChanged);
-    connect(KWindowSystem::self()
-            , static_cast<void (KWindowSystem::*)(WId)>(&KWindowSystem::windowChanged)
-            , this
-            , &AppMenuModel::onWindowChanged);
-    connect(KWindowSystem::self()
-            , static_cast<void (KWindowSystem::*)(WId)>(&KWindowSystem::windowRemoved)
-            , this
-            , &AppMenuModel::onWindowRemoved);
+    // KWindowSystem::windowChanged/windowRemoved and the X11 property
+    // changes are forwarded by AppMenuWindowTracker, for our window only.
 
     connect(this, &AppMenuModel::modelNeedsUpdate, this, [this] {
         if (!m_updatePending)
@@ -117,7 +201,12 @@ AppMenuModel::AppMenuModel(QObject *parent)
     });
 }
 
-AppMenuModel::~AppMenuModel() = default;
+AppMenuModel::~AppMenuModel()
+{
+    AppMenuWindowTracker::unwatch(m_currentWindowId, this);
+    AppMenuWindowTracker::unwatchProperties(m_delayedMenuWindowId, this);
+    releaseCurrentImporter();
+}
 
 bool AppMenuModel::filterByActive() const
 {
@@ -207,29 +296,201 @@ void AppMenuModel::setWinId(const QVariant &id)
     emit winIdChanged();
 }
 
-int AppMenuModel::rowCount(const QModelIndex &parent) const
+bool AppMenuModel::prefetchSubmenus() const
 {
-    Q_UNUSED(parent);
+    return m_prefetchSubmenus;
+}
 
-    if (!m_menuAvailable || !m_menu) {
-        return 0;
+void AppMenuModel::setPrefetchSubmenus(bool prefetch)
+{
+    if (m_prefetchSubmenus == prefetch) {
+        return;
+    }
+
+    m_prefetchSubmenus = prefetch;
+    // The setting is the same for every decoration, so it doesn't matter
+    // which of the models sharing the importer sets it.
+    if (m_importer) {
+        m_importer->setLayoutDepth(menuLayoutDepth(m_prefetchSubmenus));
+    }
+    if (!m_prefetchSubmenus) {
+        m_prefetchTimer->stop();
+        m_prefetchQueue.clear();
+    }
+    emit prefetchSubmenusChanged();
+}
+
+void AppMenuModel::fetchSubmenu(int row)
+{
+    QAction *action = m_actions.value(row);
+    if (action && action->menu()) {
+        fetchMenu(action->menu());
+    }
+}
+
+void AppMenuModel::fetchMenu(QMenu *menu)
+{
+    // A menu with actions is refreshed by the importer when it is shown.
+    if (!m_importer || !menu->actions().isEmpty() || m_fetchingMenus.contains(menu)) {
+        return;
     }
 
-    return m_menu->actions().count();
+    m_prefetchQueue.removeAll(menu);
+    m_fetchingMenus << menu;
+    m_importer->updateMenu(menu);
+}
+
+void AppMenuModel::processPrefetchQueue()
+{
+    m_fetchingMenus.removeAll(QPointer<QMenu>());
+
+    while (!m_prefetchQueue.isEmpty() && m_fetchingMenus.count() < s_maxConcurrentPrefetches) {
+        const QPointer<QMenu> menu = m_prefetchQueue.takeFirst();
+        if (menu) {
+            fetchMenu(menu);
+        }
+    }
+}
+
+void AppMenuModel::onSubmenuUpdated(QMenu *menu)
+{
+    if (!m_fetchingMenus.removeOne(menu)) {
+        return;
+    }
+
+    // Keep going while the window stays idle.
+    if (!m_prefetchQueue.isEmpty() && !m_prefetchTimer->isActive()) {
+        m_prefetchTimer->start();
+    }
+}
+
+int AppMenuModel::rowCount(const QModelIndex &parent) const
+{
+    Q_UNUSED(parent);
+
+    return m_actions.count();
 }
 
 void AppMenuModel::update()
 {
     // qCDebug(category) << "AppMenuModel::update (" << m_winId << ")";
-    beginResetModel();
-    endResetModel();
     m_updatePending = false;
+
+    QVector<QPointer<QAction>> actions;
+    if (m_menuAvailable && m_menu) {
+        for (QAction *a : m_menu->actions()) {
+            actions << a;
+        }
+    }
+
+    // The importer reuses the QAction of an item that is still in the
+    // layout, so comparing pointers tells which rows came and went.
+    QVector<QPointer<QAction>> kept;
+    for (const auto &a : qAsConst(m_actions)) {
+        if (a && actions.contains(a)) {
+            kept << a;
+        }
+    }
+
+    QVector<QPointer<QAction>> keptInNewOrder;
+    for (const auto &a : qAsConst(actions)) {
+        if (kept.contains(a)) {
+            keptInNewOrder << a;
+        }
+    }
+
+    if (kept != keptInNewOrder) {
+        // Items were reordered, which the buttons can't follow row by row.
+        beginResetModel();
+        for (const auto &a : qAsConst(m_actions)) {
+            untrackAction(a);
+        }
+        m_actions = actions;
+        for (const auto &a : qAsConst(m_actions)) {
+            trackAction(a);
+        }
+        endResetModel();
+        return;
+    }
+
+    // Remove from the back, so the rows in front keep their index.
+    for (int row = m_actions.count() - 1; row >= 0; --row) {
+        const QPointer<QAction> a = m_actions.at(row);
+        if (a && kept.contains(a)) {
+            continue;
+        }
+
+        beginRemoveRows(QModelIndex(), row, row);
+        untrackAction(a);
+        m_actions.remove(row);
+        endRemoveRows();
+    }
+
+    // What is left is in the new order, so every mismatch is a new item.
+    for (int row = 0; row < actions.count(); ++row) {
+        if (row < m_actions.count() && m_actions.at(row) == actions.at(row)) {
+            continue;
+        }
+
+        beginInsertRows(QModelIndex(), row, row);
+        m_actions.insert(row, actions.at(row));
+        trackAction(actions.at(row));
+        endInsertRows();
+    }
+}
+
+void AppMenuModel::trackAction(QAction *a)
+{
+    // signal dataChanged when the action changes
+    connect(a, &QAction::changed, this, [this, a] {
+        const int actionIdx = m_actions.indexOf(a);
+
+        if (actionIdx > -1) {
+            const QModelIndex modelIdx = index(actionIdx, 0);
+            emit dataChanged(modelIdx, modelIdx);
+        }
+    });
+
+    connect(a, &QAction::destroyed, this, &AppMenuModel::modelNeedsUpdate);
+}
+
+void AppMenuModel::untrackAction(QAction *a)
+{
+    if (a) {
+        disconnect(a, nullptr, this, nullptr);
+    }
 }
 
 
+void AppMenuModel::setCurrentWindowId(WId id)
+{
+    if (m_currentWindowId == id) {
+        return;
+    }
+
+    AppMenuWindowTracker::unwatch(m_currentWindowId, this);
+    m_currentWindowId = id;
+    if (m_currentWindowId) {
+        AppMenuWindowTracker::self()->watch(m_currentWindowId, this);
+    }
+}
+
+void AppMenuModel::setDelayedMenuWindowId(WId id)
+{
+    if (m_delayedMenuWindowId == id) {
+        return;
+    }
+
+    AppMenuWindowTracker::unwatchProperties(m_delayedMenuWindowId, this);
+    m_delayedMenuWindowId = id;
+    if (m_delayedMenuWindowId) {
+        AppMenuWindowTracker::self()->watchProperties(m_delayedMenuWindowId, this);
+    }
+}
+
 void AppMenuModel::onActiveWindowChanged(WId id)
 {
-    qApp->removeNativeEventFilter(this);
+    setDelayedMenuWindowId(0);
     // qCDebug(category) << "AppMenuModel::onActiveWindowChanged" << id << " ( == " << m_winId << ")";
 
     if (m_winId!=-1  && m_winId!=id) {
@@ -246,55 +507,13 @@ void AppMenuModel::onActiveWindowChanged(WId id)
 #if HAVE_X11
 
     if (KWindowSystem::isPlatformX11()) {
-        auto *c = QX11Info::connection();
-
-        auto getWindowPropertyString = [c](WId id, const QByteArray &name) -> QByteArray {
-            QByteArray value;
-
-            if (!s_atoms.contains(name))
-            {
-                const xcb_intern_atom_cookie_t atomCookie = xcb_intern_atom(c, false, name.length(), name.constData());
-                QScopedPointer<xcb_intern_atom_reply_t, QScopedPointerPodDeleter> atomReply(xcb_intern_atom_reply(c, atomCookie, nullptr));
-
-                if (atomReply.isNull()) {
-                    return value;
-                }
-
-                s_atoms[name] = atomReply->atom;
-
-                if (s_atoms[name] == XCB_ATOM_NONE) {
-                    return value;
-                }
-            }
-
-            static const long MAX_PROP_SIZE = 10000;
-            auto propertyCookie = xcb_get_property(c, false, id, s_atoms[name], XCB_ATOM_STRING, 0, MAX_PROP_SIZE);
-            QScopedPointer<xcb_get_property_reply_t, QScopedPointerPodDeleter> propertyReply(xcb_get_property_reply(c, propertyCookie, nullptr));
-
-            if (propertyReply.isNull())
-            {
-                return value;
-            }
+        auto *tracker = AppMenuWindowTracker::self();
 
-            if (propertyReply->type == XCB_ATOM_STRING && propertyReply->format == 8 && propertyReply->value_len > 0)
-            {
-                const char *data = (const char *) xcb_get_property_value(propertyReply.data());
-                int len = propertyReply->value_len;
+        auto updateMenuFromWindowIfHasMenu = [this, tracker](WId id) {
+            const AppMenuAddress address = tracker->menuAddress(id);
 
-                if (data) {
-                    value = QByteArray(data, data[len - 1] ? len : len - 1);
-                }
-            }
-
-            return value;
-        };
-
-        auto updateMenuFromWindowIfHasMenu = [this, &getWindowPropertyString](WId id) {
-            const QString serviceName = QString::fromUtf8(getWindowPropertyString(id, s_x11AppMenuServiceNamePropertyName));
-            const QString menuObjectPath = QString::fromUtf8(getWindowPropertyString(id, s_x11AppMenuObjectPathPropertyName));
-
-            if (!serviceName.isEmpty() && !menuObjectPath.isEmpty()) {
-                updateApplicationMenu(serviceName, menuObjectPath);
+            if (!address.isNull()) {
+                updateApplicationMenu(address.serviceName, address.objectPath);
                 return true;
             }
 
@@ -329,32 +548,37 @@ void AppMenuModel::onActiveWindowChanged(WId id)
             return;
         }
 
-        m_currentWindowId = id;
+        setCurrentWindowId(id);
+
+        // look at transient windows first
+        QVector<WId> candidates;
 
         if (!filterChildren()) {
 
             KWindowInfo transientInfo = KWindowInfo(info.transientFor(), NET::WMState | NET::WMWindowType | NET::WMGeometry, NET::WM2TransientFor);
 
-            // look at transient windows first
             while (transientInfo.win()) {
-                if (updateMenuFromWindowIfHasMenu(transientInfo.win())) {
-                    filterWindow(info);
-                    return;
-                }
+                candidates << transientInfo.win();
 
                 transientInfo = KWindowInfo(transientInfo.transientFor(), NET::WMState | NET::WMWindowType | NET::WMGeometry, NET::WM2TransientFor);
             }
         }
 
-        if (updateMenuFromWindowIfHasMenu(id)) {
-            filterWindow(info);
-            return;
+        candidates << id;
+
+        // one round trip for the windows we haven't seen yet, none for the others
+        tracker->prefetchMenuAddresses(candidates);
+
+        for (WId candidate : qAsConst(candidates)) {
+            if (updateMenuFromWindowIfHasMenu(candidate)) {
+                filterWindow(info);
+                return;
+            }
         }
 
         // monitor whether an app menu becomes available later
         // this can happen when an app starts, shows its window, and only later announces global menu (e.g. Firefox)
-        qApp->installNativeEventFilter(this);
-        m_delayedMenuWindowId = id;
+        setDelayedMenuWindowId(id);
 
         //no menu found, set it to unavailable
         setMenuAvailable(false);
@@ -412,20 +636,20 @@ QVariant AppMenuModel::data(const QModelIndex &index, int role) const
 {
     const int row = index.row();
 
-    if (row < 0 || !m_menuAvailable || !m_menu) {
+    if (row < 0 || row >= m_actions.count()) {
         return QVariant();
     }
 
-    const auto actions = m_menu->actions();
+    QAction *action = m_actions.at(row);
 
-    if (row >= actions.count()) {
+    if (!action) {
         return QVariant();
     }
 
     if (role == MenuRole) { // TODO this should be Qt::DisplayRole
-        return actions.at(row)->text();
+        return action->text();
     } else if (role == ActionRole) {
-        return QVariant::fromValue((void *) actions.at(row));
+        return QVariant::fromValue((void *) action);
     }
 
     return QVariant();
@@ -435,7 +659,7 @@ void AppMenuModel::updateApplicationMenu(const QString &serviceName, const QStri
 {
     if (m_serviceName == serviceName && m_menuObjectPath == menuObjectPath) {
         if (m_importer) {
-            QMetaObject::invokeMethod(m_importer, "updateMenu", Qt::QueuedConnection);
+            requestMenuUpdate(m_importer);
         }
 
         return;
@@ -446,95 +670,89 @@ void AppMenuModel::updateApplicationMenu(const QString &serviceName, const QStri
 
     m_menuObjectPath = menuObjectPath;
 
-    if (m_importer) {
-        m_importer->deleteLater();
-    }
-
-    m_importer = new KDBusMenuImporter(serviceName, menuObjectPath, this);
-    QMetaObject::invokeMethod(m_importer, "updateMenu", Qt::QueuedConnection);
-
-    connect(m_importer.data(), &DBusMenuImporter::menuUpdated, this, [ = ](QMenu * menu) {
-        m_menu = m_importer->menu();
-
-        if (m_menu.isNull() || menu != m_menu) {
-            return;
-        }
-
-        //cache first layer of sub menus, which we'll be popping up
-        for (QAction *a : m_menu->actions()) {
-            // signal dataChanged when the action changes
-            connect(a, &QAction::changed, this, [this, a] {
-                if (m_menuAvailable && m_menu)
-                {
-                    const int actionIdx = m_menu->actions().indexOf(a);
-
-                    if (actionIdx > -1) {
-                        const QModelIndex modelIdx = index(actionIdx, 0);
-                        emit dataChanged(modelIdx, modelIdx);
-                    }
-                }
-            });
+    releaseCurrentImporter();
 
-            connect(a, &QAction::destroyed, this, &AppMenuModel::modelNeedsUpdate);
+    bool shared = false;
+    m_importer = acquireImporter(serviceName, menuObjectPath, menuLayoutDepth(m_prefetchSubmenus), &shared);
 
-            if (a->menu()) {
-                m_importer->updateMenu(a->menu());
+    if (shared && !m_importer->menu()->actions().isEmpty()) {
+        // Another window already loaded this menu, no need to ask the app.
+        QPointer<QMenu> menu = m_importer->menu();
+        QTimer::singleShot(0, this, [this, menu] {
+            if (menu) {
+                onMenuUpdated(menu);
             }
-        }
+        });
+    } else {
+        // Joining a fetch another model started is enough, its
+        // menuUpdated() reaches this model too.
+        requestMenuUpdate(m_importer);
+    }
 
-        setMenuAvailable(true);
-        emit modelNeedsUpdate();
-    });
+    connect(m_importer.data(), &DBusMenuImporter::menuUpdated, this, &AppMenuModel::onMenuUpdated);
 
     connect(m_importer.data(), &DBusMenuImporter::actionActivationRequested, this, [this](QAction * action) {
         // TODO submenus
-        if (!m_menuAvailable || !m_menu) {
-            return;
-        }
-
-        const auto actions = m_menu->actions();
-        auto it = std::find(actions.begin(), actions.end(), action);
+        const int row = m_actions.indexOf(action);
 
-        if (it != actions.end()) {
-            requestActivateIndex(it - actions.begin());
+        if (row > -1) {
+            requestActivateIndex(row);
         }
     });
 }
 
-bool AppMenuModel::nativeEventFilter(const QByteArray &eventType, void *message, long *result)
+void AppMenuModel::releaseCurrentImporter()
 {
-    Q_UNUSED(result);
+    m_prefetchTimer->stop();
+    m_prefetchQueue.clear();
+    m_fetchingMenus.clear();
 
-    if (!KWindowSystem::isPlatformX11() || eventType != "xcb_generic_event_t") {
-        return false;
+    if (m_importer) {
+        disconnect(m_importer.data(), nullptr, this, nullptr);
+        releaseImporter(m_importer);
+        m_importer.clear();
     }
+}
 
-#if HAVE_X11
-    auto e = static_cast<xcb_generic_event_t *>(message);
-    const uint8_t type = e->response_type & ~0x80;
+void AppMenuModel::onMenuUpdated(QMenu *menu)
+{
+    if (!m_importer) {
+        return;
+    }
 
-    if (type == XCB_PROPERTY_NOTIFY) {
-        auto *event = reinterpret_cast<xcb_property_notify_event_t *>(e);
+    m_menu = m_importer->menu();
 
-        if (event->window == m_delayedMenuWindowId) {
+    if (m_menu.isNull()) {
+        return;
+    }
 
-            auto serviceNameAtom = s_atoms.value(s_x11AppMenuServiceNamePropertyName);
-            auto objectPathAtom = s_atoms.value(s_x11AppMenuObjectPathPropertyName);
+    if (menu != m_menu) {
+        onSubmenuUpdated(menu);
+        return;
+    }
 
-            if (serviceNameAtom != XCB_ATOM_NONE && objectPathAtom != XCB_ATOM_NONE) { // shouldn't happen
-                if (event->atom == serviceNameAtom || event->atom == objectPathAtom) {
-                    // see if we now have a menu
-                    onActiveWindowChanged(KWindowSystem::activeWindow());
-                }
+    // Sub menus are fetched when their button is hovered or opened.
+    // Queue the rest, so they are ready when the user gets to them
+    // without flooding the bus when the window is activated.
+    if (m_prefetchSubmenus) {
+        m_prefetchQueue.clear();
+        for (QAction *a : m_menu->actions()) {
+            if (a->menu() && a->menu()->actions().isEmpty()) {
+                m_prefetchQueue << a->menu();
             }
         }
+        if (!m_prefetchQueue.isEmpty()) {
+            m_prefetchTimer->start();
+        }
     }
 
-#else
-    Q_UNUSED(message);
-#endif
+    setMenuAvailable(true);
+    emit modelNeedsUpdate();
+}
 
-    return false;
+void AppMenuModel::onMenuAddressChanged()
+{
+    onActiveWindowChanged(KWindowSystem::activeWindow());
 }
 
 } // namespace Material
@@ -23,7 +23,6 @@
 
 // Qt
 #include <QAbstractListModel>
-#include <QAbstractNativeEventFilter>
 #include <QAction>
 #include <QDBusServiceWatcher>
 #include <QMenu>
@@ -31,6 +30,8 @@
 #include <QPointer>
 #include <QRect>
 #include <QStringList>
+#include <QTimer>
+#include <QVector>
 
 // KF
 #include <KWindowSystem>
@@ -39,9 +40,10 @@
 namespace Material
 {
 
+class AppMenuWindowTracker;
 class KDBusMenuImporter;
 
-class AppMenuModel : public QAbstractListModel, public QAbstractNativeEventFilter
+class AppMenuModel : public QAbstractListModel
 {
     Q_OBJECT
 
@@ -54,6 +56,8 @@ class AppMenuModel : public QAbstractListModel, public QAbstractNativeEventFilte
     Q_PROPERTY(QRect screenGeometry READ screenGeometry WRITE setScreenGeometry NOTIFY screenGeometryChanged)
 
     Q_PROPERTY(QVariant winId READ winId WRITE setWinId NOTIFY winIdChanged)
+
+    Q_PROPERTY(bool prefetchSubmenus READ prefetchSubmenus WRITE setPrefetchSubmenus NOTIFY prefetchSubmenusChanged)
 public:
     explicit AppMenuModel(QObject *parent = nullptr);
     ~AppMenuModel() override;
@@ -70,6 +74,9 @@ public:
 
     void updateApplicationMenu(const QString &serviceName, const QString &menuObjectPath);
 
+    //! deletes the importers the models share, once the last decoration is gone
+    static void releaseSharedImporters();
+
     bool filterByActive() const;
     void setFilterByActive(bool active);
 
@@ -87,12 +94,18 @@ public:
     QVariant winId() const;
     void setWinId(const QVariant &id);
 
+    //! load the submenus in the background, a few at a time, once the
+    //! window has been idle for a moment
+    bool prefetchSubmenus() const;
+    void setPrefetchSubmenus(bool prefetch);
+
+    //! load the submenu of @p row unless it is loaded or loading already,
+    //! e.g. when the pointer rests on its button
+    void fetchSubmenu(int row);
+
 signals:
     void requestActivateIndex(int index);
 
-protected:
-    bool nativeEventFilter(const QByteArray &eventType, void *message, long int *result) override;
-
 private Q_SLOTS:
     void onActiveWindowChanged(WId id);
     void onWindowChanged(WId id);
@@ -100,11 +113,19 @@ private Q_SLOTS:
     //! and as such their menu is still shown even though the app does not exist
     //! any more. Such apps are Java based e.g. smartgit
     void onWindowRemoved(WId id);
+    //! the window that may announce its menu later has changed its menu properties
+    void onMenuAddressChanged();
     void filterWindow(KWindowInfo &info);
 
     void setVisible(bool visible);
     void update();
 
+    //! start queued submenu fetches, up to the concurrency limit
+    void processPrefetchQueue();
+
+    //! the importer has loaded @p menu, the root menu or one of its submenus
+    void onMenuUpdated(QMenu *menu);
+
 signals:
     void menuAvailableChanged();
     void modelNeedsUpdate();
@@ -113,8 +134,25 @@ signals:
     void visibleChanged();
     void screenGeometryChanged();
     void winIdChanged();
+    void prefetchSubmenusChanged();
 
 private:
+    friend class AppMenuWindowTracker;
+
+    void setCurrentWindowId(WId id);
+    void setDelayedMenuWindowId(WId id);
+
+    //! forward changes of a row's action as dataChanged
+    void trackAction(QAction *a);
+    void untrackAction(QAction *a);
+
+    //! unsubscribe from the importer, which is shared with other models
+    void releaseCurrentImporter();
+
+    //! @p menu was fetched, or failed to
+    void onSubmenuUpdated(QMenu *menu);
+    void fetchMenu(QMenu *menu);
+
     bool m_filterByActive = false;
     bool m_filterChildren = false;
     bool m_menuAvailable;
@@ -131,12 +169,20 @@ private:
     WId m_delayedMenuWindowId = 0;
 
     QPointer<QMenu> m_menu;
+    //! the rows, as of the last update()
+    QVector<QPointer<QAction>> m_actions;
 
     QDBusServiceWatcher *m_serviceWatcher;
     QString m_serviceName;
     QString m_menuObjectPath;
 
     QPointer<KDBusMenuImporter> m_importer;
+
+    bool m_prefetchSubmenus = true;
+    QTimer *m_prefetchTimer;
+    QVector<QPointer<QMenu>> m_prefetchQueue;
+    //! submenus with a fetch in flight
+    QVector<QPointer<QMenu>> m_fetchingMenus;
 };
 
 } // namespace Material
@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2020 Chris Holland <zrenfire@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// own
+#include "AppMenuWindowTracker.h"
+#include "AppMenuModel.h"
+#include "BuildConfig.h"
+#include "Decoration.h"
+#include "X11Atoms.h"
+
+#if HAVE_X11
+#include <QX11Info>
+#include <xcb/xcb.h>
+#endif
+
+// KF
+#include <KWindowSystem>
+
+// Qt
+#include <QGuiApplication>
+
+
+namespace Material
+{
+
+#if HAVE_X11
+static QString propertyString(xcb_connection_t *c, uint sequence)
+{
+    xcb_get_property_cookie_t propertyCookie = { sequence };
+    QScopedPointer<xcb_get_property_reply_t, QScopedPointerPodDeleter> propertyReply(xcb_get_property_reply(c, propertyCookie, nullptr));
+
+    if (propertyReply.isNull()) {
+        return QString();
+    }
+
+    QByteArray value;
+
+    if (propertyReply->type == XCB_ATOM_STRING && propertyReply->format == 8 && propertyReply->value_len > 0) {
+        const char *data = (const char *) xcb_get_property_value(propertyReply.data());
+        int len = propertyReply->value_len;
+
+        if (data) {
+            value = QByteArray(data, data[len - 1] ? len : len - 1);
+        }
+    }
+
+    return QString::fromUtf8(value);
+}
+#endif
+
+AppMenuWindowTracker *AppMenuWindowTracker::s_self = nullptr;
+
+AppMenuWindowTracker::AppMenuWindowTracker()
+{
+    connect(KWindowSystem::self()
+            , static_cast<void (KWindowSystem::*)(WId)>(&KWindowSystem::windowChanged)
+            , this
+            , &AppMenuWindowTracker::onWindowChanged);
+    // Only this overload says what changed. KWin sends a synthetic
+    // ConfigureNotify to the client on every move, which KWindowSystem
+    // reports as NET::WMGeometry.
+    connect(KWindowSystem::self()
+            , static_cast<void (KWindowSystem::*)(WId, NET::Properties, NET::Properties2)>(&KWindowSystem::windowChanged)
+            , this
+            , &AppMenuWindowTracker::onWindowPropertiesChanged);
+    connect(KWindowSystem::self()
+            , static_cast<void (KWindowSystem::*)(WId)>(&KWindowSystem::windowRemoved)
+            , this
+            , &AppMenuWindowTracker::onWindowRemoved);
+
+    // Watches the properties of every window with a cached menu address.
+    qApp->installNativeEventFilter(this);
+}
+
+AppMenuWindowTracker::~AppMenuWindowTracker()
+{
+    qApp->removeNativeEventFilter(this);
+
+    const auto pending = m_pendingMenuAddresses.keys();
+    for (WId id : pending) {
+        discardMenuAddress(id);
+    }
+
+    s_self = nullptr;
+}
+
+AppMenuWindowTracker *AppMenuWindowTracker::self()
+{
+    if (!s_self) {
+        s_self = new AppMenuWindowTracker();
+    }
+    return s_self;
+}
+
+void AppMenuWindowTracker::release()
+{
+    delete s_self;
+}
+
+void AppMenuWindowTracker::watch(WId id, AppMenuModel *model)
+{
+    if (!m_windows.contains(id, model)) {
+        m_windows.insert(id, model);
+    }
+}
+
+void AppMenuWindowTracker::unwatch(WId id, AppMenuModel *model)
+{
+    if (s_self) {
+        s_self->m_windows.remove(id, model);
+    }
+}
+
+void AppMenuWindowTracker::watchProperties(WId id, AppMenuModel *model)
+{
+    if (!m_propertyWindows.contains(id, model)) {
+        m_propertyWindows.insert(id, model);
+    }
+}
+
+void AppMenuWindowTracker::unwatchProperties(WId id, AppMenuModel *model)
+{
+    if (s_self) {
+        s_self->m_propertyWindows.remove(id, model);
+    }
+}
+
+void AppMenuWindowTracker::watchGeometry(WId id, const Decoration *decoration)
+{
+    if (!m_geometryWindows.contains(id, decoration)) {
+        m_geometryWindows.insert(id, decoration);
+    }
+}
+
+void AppMenuWindowTracker::unwatchGeometry(WId id, const Decoration *decoration)
+{
+    if (s_self) {
+        s_self->m_geometryWindows.remove(id, decoration);
+    }
+}
+
+void AppMenuWindowTracker::prefetchMenuAddresses(const QVector<WId> &ids)
+{
+#if HAVE_X11
+    auto *c = QX11Info::connection();
+    const xcb_atom_t serviceNameAtom = X11Atoms::atom(X11Atoms::AppMenuServiceName);
+    const xcb_atom_t objectPathAtom = X11Atoms::atom(X11Atoms::AppMenuObjectPath);
+
+    if (serviceNameAtom == XCB_ATOM_NONE || objectPathAtom == XCB_ATOM_NONE) {
+        return;
+    }
+
+    static const long MAX_PROP_SIZE = 10000;
+    bool issued = false;
+
+    for (WId id : ids) {
+        if (!id || m_menuAddresses.contains(id) || m_pendingMenuAddresses.contains(id)) {
+            continue;
+        }
+
+        PendingMenuAddress pending;
+        pending.serviceName = xcb_get_property(c, false, id, serviceNameAtom, XCB_ATOM_STRING, 0, MAX_PROP_SIZE).sequence;
+        pending.objectPath = xcb_get_property(c, false, id, objectPathAtom, XCB_ATOM_STRING, 0, MAX_PROP_SIZE).sequence;
+        m_pendingMenuAddresses.insert(id, pending);
+        issued = true;
+    }
+
+    // Replies that nobody asks for are picked up once we're back in the event loop.
+    if (issued && !m_collectScheduled) {
+        m_collectScheduled = true;
+        QMetaObject::invokeMethod(this, "collectMenuAddresses", Qt::QueuedConnection);
+    }
+#else
+    Q_UNUSED(ids);
+#endif
+}
+
+AppMenuAddress AppMenuWindowTracker::menuAddress(WId id)
+{
+    auto it = m_menuAddresses.constFind(id);
+    if (it != m_menuAddresses.constEnd()) {
+        return *it;
+    }
+
+    prefetchMenuAddresses({id});
+    collectMenuAddress(id);
+
+    return m_menuAddresses.value(id);
+}
+
+void AppMenuWindowTracker::collectMenuAddresses()
+{
+    m_collectScheduled = false;
+
+    const auto pending = m_pendingMenuAddresses.keys();
+    for (WId id : pending) {
+        collectMenuAddress(id);
+    }
+}
+
+void AppMenuWindowTracker::collectMenuAddress(WId id)
+{
+    if (!m_pendingMenuAddresses.contains(id)) {
+        return;
+    }
+
+    const PendingMenuAddress pending = m_pendingMenuAddresses.take(id);
+
+#if HAVE_X11
+    auto *c = QX11Info::connection();
+
+    AppMenuAddress address;
+    address.serviceName = propertyString(c, pending.serviceName);
+    address.objectPath = propertyString(c, pending.objectPath);
+    m_menuAddresses.insert(id, address);
+#else
+    Q_UNUSED(pending);
+#endif
+}
+
+void AppMenuWindowTracker::discardMenuAddress(WId id)
+{
+    m_menuAddresses.remove(id);
+
+    if (!m_pendingMenuAddresses.contains(id)) {
+        return;
+    }
+
+    const PendingMenuAddress pending = m_pendingMenuAddresses.take(id);
+
+#if HAVE_X11
+    auto *c = QX11Info::connection();
+    xcb_discard_reply(c, pending.serviceName);
+    xcb_discard_reply(c, pending.objectPath);
+#else
+    Q_UNUSED(pending);
+#endif
+}
+
+void AppMenuWindowTracker::onWindowChanged(WId id)
+{
+    // Copied, as a model may register another window while handling it.
+    const auto models = m_windows.values(id);
+    for (AppMenuModel *model : models) {
+        model->onWindowChanged(id);
+    }
+}
+
+void AppMenuWindowTracker::onWindowPropertiesChanged(WId id, NET::Properties properties, NET::Properties2 properties2)
+{
+    Q_UNUSED(properties2);
+
+    if (!(properties & NET::WMGeometry)) {
+        return;
+    }
+
+    const auto decorations = m_geometryWindows.values(id);
+    for (const Decoration *decoration : decorations) {
+        decoration->invalidateWindowPos();
+    }
+}
+
+void AppMenuWindowTracker::onWindowRemoved(WId id)
+{
+    discardMenuAddress(id);
+
+    const auto models = m_windows.values(id);
+    for (AppMenuModel *model : models) {
+        model->onWindowRemoved(id);
+    }
+}
+
+bool AppMenuWindowTracker::nativeEventFilter(const QByteArray &eventType, void *message, long *result)
+{
+    Q_UNUSED(result);
+
+    if (eventType != "xcb_generic_event_t") {
+        return false;
+    }
+
+#if HAVE_X11
+    auto e = static_cast<xcb_generic_event_t *>(message);
+    const uint8_t type = e->response_type & ~0x80;
+
+    if (type == XCB_PROPERTY_NOTIFY) {
+        auto *event = reinterpret_cast<xcb_property_notify_event_t *>(e);
+
+        auto serviceNameAtom = X11Atoms::atom(X11Atoms::AppMenuServiceName);
+        auto objectPathAtom = X11Atoms::atom(X11Atoms::AppMenuObjectPath);
+
+        if (serviceNameAtom == XCB_ATOM_NONE || objectPathAtom == XCB_ATOM_NONE) { // shouldn't happen
+            return false;
+        }
+
+        if (event->atom != serviceNameAtom && event->atom != objectPathAtom) {
+            return false;
+        }
+
+        discardMenuAddress(event->window);
+
+        // see if the window now has a menu
+        const auto models = m_propertyWindows.values(event->window);
+        for (AppMenuModel *model : models) {
+            model->onMenuAddressChanged();
+        }
+    }
+
+#else
+    Q_UNUSED(message);
+#endif
+
+    return false;
+}
+
+} // namespace Material
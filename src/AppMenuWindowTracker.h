@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2020 Chris Holland <zrenfire@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// KF
+#include <netwm_def.h>
+
+// Qt
+#include <QAbstractNativeEventFilter>
+#include <QHash>
+#include <QMultiHash>
+#include <QObject>
+#include <QString>
+#include <QVector>
+#include <QWindow>
+
+
+namespace Material
+{
+
+class AppMenuModel;
+class Decoration;
+
+//* where a window exports its menu, from the _KDE_NET_WM_APPMENU_* properties
+struct AppMenuAddress
+{
+    QString serviceName;
+    QString objectPath;
+
+    bool isNull() const {
+        return serviceName.isEmpty() || objectPath.isEmpty();
+    }
+};
+
+/**
+ * Watches windows on behalf of every AppMenuModel in the process.
+ *
+ * KWindowSystem and the X11 event stream are hooked up once, and each
+ * change is forwarded only to the models that registered the window, so
+ * the cost of an event does not grow with the number of decorations.
+ *
+ * The menu address of each window is cached until a property notify for
+ * one of the two properties, or the removal of the window, invalidates it.
+ */
+class AppMenuWindowTracker : public QObject, public QAbstractNativeEventFilter
+{
+    Q_OBJECT
+
+public:
+    ~AppMenuWindowTracker() override;
+
+    static AppMenuWindowTracker *self();
+
+    //* deletes the instance, once no decoration is left
+    static void release();
+
+    //* forward windowChanged/windowRemoved of @p id to @p model
+    void watch(WId id, AppMenuModel *model);
+    //* does nothing once the tracker has been released
+    static void unwatch(WId id, AppMenuModel *model);
+
+    //* forward property changes of @p id to @p model, while it waits for a menu
+    void watchProperties(WId id, AppMenuModel *model);
+    //* does nothing once the tracker has been released
+    static void unwatchProperties(WId id, AppMenuModel *model);
+
+    //* invalidate the cached window position of @p decoration when @p id moves
+    void watchGeometry(WId id, const Decoration *decoration);
+    //* does nothing once the tracker has been released
+    static void unwatchGeometry(WId id, const Decoration *decoration);
+
+    //* request the menu address of @p ids in one go, without waiting for the replies
+    void prefetchMenuAddresses(const QVector<WId> &ids);
+    //* only waits for the X server if the address of @p id isn't known yet
+    AppMenuAddress menuAddress(WId id);
+
+protected:
+    bool nativeEventFilter(const QByteArray &eventType, void *message, long int *result) override;
+
+private Q_SLOTS:
+    //* store the replies of all requests issued by prefetchMenuAddresses()
+    void collectMenuAddresses();
+
+private:
+    AppMenuWindowTracker();
+
+    void onWindowChanged(WId id);
+    void onWindowPropertiesChanged(WId id, NET::Properties properties, NET::Properties2 properties2);
+    void onWindowRemoved(WId id);
+
+    void collectMenuAddress(WId id);
+    void discardMenuAddress(WId id);
+
+    //* sequence numbers of the pending xcb_get_property requests
+    struct PendingMenuAddress
+    {
+        uint serviceName;
+        uint objectPath;
+    };
+
+    QMultiHash<WId, AppMenuModel *> m_windows;
+    QMultiHash<WId, AppMenuModel *> m_propertyWindows;
+    QMultiHash<WId, const Decoration *> m_geometryWindows;
+
+    QHash<WId, AppMenuAddress> m_menuAddresses;
+    QHash<WId, PendingMenuAddress> m_pendingMenuAddresses;
+    bool m_collectScheduled = false;
+
+    static AppMenuWindowTracker *s_self;
+};
+
+} // namespace Material
@@ -22,7 +22,19 @@
 #include <QVector>
 
 // std
+#include <atomic>
 #include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// AVX2 is picked at runtime, so it does not depend on the compiler flags.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BOXSHADOW_HAVE_AVX2
+#include <immintrin.h>
+#endif
 
 
 namespace Material
@@ -39,6 +51,9 @@ namespace
 // blur scale, area under the kernel equals to 0.98, which is pretty enough.
 // Maybe, it should be changed in the future.
 const qreal SIGMA_BLUR_SCALE = 0.4375;
+
+// Three box passes are close enough to a real Gaussian.
+const int BLUR_ITERATIONS = 3;
 } // anonymous namespace
 
 inline qreal radiusToSigma(qreal radius)
@@ -75,93 +90,413 @@ QVector<int> computeBoxSizes(int radius, int numIterations)
     return boxSizes;
 }
 
-void boxBlurPass(const QImage &src, QImage &dst, int boxSize)
+// Box sums are divided with a 16-bit fixed-point reciprocal instead of a
+// float multiply.
+inline quint32 boxReciprocal(int boxSize)
 {
-    const int alphaStride = src.depth() >> 3;
-    const int alphaOffset = QSysInfo::ByteOrder == QSysInfo::BigEndian ? 0 : 3;
+    return (65536 + boxSize - 1) / boxSize;
+}
 
+// Box sums start at half the box size, so that this floor division rounds
+// to the nearest value. Flooring each of the six passes would make the
+// shadow up to 3 levels lighter than the exact convolution boxShadow()
+// computes.
+inline quint32 boxRoundingBias(int boxSize)
+{
+    return boxSize / 2;
+}
+
+// Floor division of a box sum. The rounded-up reciprocal overshoots the
+// quotient by at most one as long as the sum fits into 16 bits, a remainder
+// check corrects that.
+inline quint32 boxDivide(quint32 sum, quint32 mul, int boxSize)
+{
+    quint32 quotient = (sum * mul) >> 16;
+    while (quotient * boxSize > sum) {
+        --quotient;
+    }
+    return quotient;
+}
+
+// Largest box whose running sum, bias included, still fits into 16-bit
+// lanes.
+const int MAX_SIMD_BOX_SIZE = 255;
+
+// All blur kernels below work on a tightly packed 8-bit plane and blur it
+// along the y axis. Columns are independent of each other, so the vector
+// versions process 16 or 32 of them per iteration. Pixels outside of the
+// plane count as transparent.
+void blurColumnsScalar(const uchar *src, uchar *dst, int width, int height, int boxSize, int firstColumn = 0)
+{
     const int radius = boxSizeToRadius(boxSize);
-    const qreal invSize = 1.0 / boxSize;
+    const quint32 mul = boxReciprocal(boxSize);
+    const int count = width - firstColumn;
 
-    const int dstStride = dst.width() * alphaStride;
+    QVector<quint32> window(count, boxRoundingBias(boxSize));
+    quint32 *sums = window.data();
 
-    for (int y = 0; y < src.height(); ++y) {
-        const uchar *srcAlpha = src.scanLine(y);
-        uchar *dstAlpha = dst.scanLine(0);
+    src += firstColumn;
+    dst += firstColumn;
 
-        srcAlpha += alphaOffset;
-        dstAlpha += alphaOffset + y * alphaStride;
+    for (int y = 0; y < qMin(radius, height); ++y) {
+        const uchar *row = src + y * width;
+        for (int x = 0; x < count; ++x) {
+            sums[x] += row[x];
+        }
+    }
 
-        const uchar *left = srcAlpha;
-        const uchar *right = left + alphaStride * radius;
+    for (int y = 0; y < height; ++y) {
+        if (y + radius < height) {
+            const uchar *right = src + (y + radius) * width;
+            for (int x = 0; x < count; ++x) {
+                sums[x] += right[x];
+            }
+        }
+        if (y > radius) {
+            const uchar *left = src + (y - radius - 1) * width;
+            for (int x = 0; x < count; ++x) {
+                sums[x] -= left[x];
+            }
+        }
+        uchar *out = dst + y * width;
+        for (int x = 0; x < count; ++x) {
+            out[x] = static_cast<uchar>(boxDivide(sums[x], mul, boxSize));
+        }
+    }
+}
+
+#if defined(__SSE2__)
+// See boxDivide(). The remainder is smaller than boxSize in magnitude, so it
+// can be tested as a signed 16-bit value.
+inline __m128i boxDivideSse2(__m128i sum, __m128i mul, __m128i box)
+{
+    const __m128i quotient = _mm_mulhi_epu16(sum, mul);
+    const __m128i remainder = _mm_sub_epi16(sum, _mm_mullo_epi16(quotient, box));
+    return _mm_add_epi16(quotient, _mm_cmpgt_epi16(_mm_setzero_si128(), remainder));
+}
 
-        int window = 0;
-        for (int x = 0; x < radius; ++x) {
-            window += *srcAlpha;
-            srcAlpha += alphaStride;
+void blurColumnsSse2(const uchar *src, uchar *dst, int width, int height, int boxSize)
+{
+    const int radius = boxSizeToRadius(boxSize);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mul = _mm_set1_epi16(static_cast<short>(boxReciprocal(boxSize)));
+    const __m128i box = _mm_set1_epi16(static_cast<short>(boxSize));
+    const __m128i bias = _mm_set1_epi16(static_cast<short>(boxRoundingBias(boxSize)));
+
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i lo = bias;
+        __m128i hi = bias;
+
+        for (int y = 0; y < qMin(radius, height); ++y) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + y * width + x));
+            lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+            hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
         }
 
-        for (int x = 0; x <= radius; ++x) {
-            window += *right;
-            right += alphaStride;
-            *dstAlpha = static_cast<uchar>(window * invSize);
-            dstAlpha += dstStride;
+        for (int y = 0; y < height; ++y) {
+            if (y + radius < height) {
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + (y + radius) * width + x));
+                lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+                hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
+            }
+            if (y > radius) {
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + (y - radius - 1) * width + x));
+                lo = _mm_sub_epi16(lo, _mm_unpacklo_epi8(v, zero));
+                hi = _mm_sub_epi16(hi, _mm_unpackhi_epi8(v, zero));
+            }
+            const __m128i out = _mm_packus_epi16(boxDivideSse2(lo, mul, box), boxDivideSse2(hi, mul, box));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + y * width + x), out);
         }
+    }
+
+    if (x < width) {
+        blurColumnsScalar(src, dst, width, height, boxSize, x);
+    }
+}
+#endif
 
-        for (int x = radius + 1; x < src.width() - radius; ++x) {
-            window += *right - *left;
-            left += alphaStride;
-            right += alphaStride;
-            *dstAlpha = static_cast<uchar>(window * invSize);
-            dstAlpha += dstStride;
+#if defined(BOXSHADOW_HAVE_AVX2)
+__attribute__((target("avx2")))
+inline __m256i boxDivideAvx2(__m256i sum, __m256i mul, __m256i box)
+{
+    const __m256i quotient = _mm256_mulhi_epu16(sum, mul);
+    const __m256i remainder = _mm256_sub_epi16(sum, _mm256_mullo_epi16(quotient, box));
+    return _mm256_add_epi16(quotient, _mm256_cmpgt_epi16(_mm256_setzero_si256(), remainder));
+}
+
+__attribute__((target("avx2")))
+void blurColumnsAvx2(const uchar *src, uchar *dst, int width, int height, int boxSize)
+{
+    const int radius = boxSizeToRadius(boxSize);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i mul = _mm256_set1_epi16(static_cast<short>(boxReciprocal(boxSize)));
+    const __m256i box = _mm256_set1_epi16(static_cast<short>(boxSize));
+    const __m256i bias = _mm256_set1_epi16(static_cast<short>(boxRoundingBias(boxSize)));
+
+    // unpack{lo,hi} and packus both work on 128-bit lanes, so packing
+    // the two halves back together restores the original byte order.
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i lo = bias;
+        __m256i hi = bias;
+
+        for (int y = 0; y < qMin(radius, height); ++y) {
+            const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + y * width + x));
+            lo = _mm256_add_epi16(lo, _mm256_unpacklo_epi8(v, zero));
+            hi = _mm256_add_epi16(hi, _mm256_unpackhi_epi8(v, zero));
         }
 
-        for (int x = src.width() - radius; x < src.width(); ++x) {
-            window -= *left;
-            left += alphaStride;
-            *dstAlpha = static_cast<uchar>(window * invSize);
-            dstAlpha += dstStride;
+        for (int y = 0; y < height; ++y) {
+            if (y + radius < height) {
+                const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + (y + radius) * width + x));
+                lo = _mm256_add_epi16(lo, _mm256_unpacklo_epi8(v, zero));
+                hi = _mm256_add_epi16(hi, _mm256_unpackhi_epi8(v, zero));
+            }
+            if (y > radius) {
+                const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + (y - radius - 1) * width + x));
+                lo = _mm256_sub_epi16(lo, _mm256_unpacklo_epi8(v, zero));
+                hi = _mm256_sub_epi16(hi, _mm256_unpackhi_epi8(v, zero));
+            }
+            const __m256i out = _mm256_packus_epi16(boxDivideAvx2(lo, mul, box), boxDivideAvx2(hi, mul, box));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + y * width + x), out);
         }
     }
+
+    if (x < width) {
+        blurColumnsScalar(src, dst, width, height, boxSize, x);
+    }
+}
+#endif
+
+using BlurColumnsFunc = void (*)(const uchar *, uchar *, int, int, int);
+
+void blurColumnsScalarAll(const uchar *src, uchar *dst, int width, int height, int boxSize)
+{
+    blurColumnsScalar(src, dst, width, height, boxSize);
+}
+
+// Set by setBlurKernel(), null means the one resolveBlurColumns() picks.
+std::atomic<BlurColumnsFunc> s_forcedBlurColumns(nullptr);
+
+BlurColumnsFunc resolveBlurColumns()
+{
+#if defined(BOXSHADOW_HAVE_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return blurColumnsAvx2;
+    }
+#endif
+#if defined(__SSE2__)
+    return blurColumnsSse2;
+#else
+    return blurColumnsScalarAll;
+#endif
+}
+
+void blurColumns(const uchar *src, uchar *dst, int width, int height, int boxSize)
+{
+    if (boxSize <= 1) {
+        std::memcpy(dst, src, static_cast<size_t>(width) * height);
+        return;
+    }
+
+    if (boxSize > MAX_SIMD_BOX_SIZE) {
+        blurColumnsScalar(src, dst, width, height, boxSize);
+        return;
+    }
+
+    static const BlurColumnsFunc resolved = resolveBlurColumns();
+    const BlurColumnsFunc forced = s_forcedBlurColumns.load(std::memory_order_relaxed);
+    (forced ? forced : resolved)(src, dst, width, height, boxSize);
 }
 
-void boxBlurAlpha(QImage &image, int radius, int numIterations)
+#if defined(__SSE2__)
+// Transposes a 16x16 tile with the usual unpack network: interleaving
+// bytes, words, dwords and qwords of row pairs yields the columns.
+void transposeTileSse2(const uchar *src, int srcStride, uchar *dst, int dstStride)
 {
-    // Temporary buffer is transposed so we always read memory
-    // in linear order.
-    QImage tmp(image.height(), image.width(), image.format());
+    __m128i a[16];
+    __m128i b[16];
+
+    for (int i = 0; i < 16; ++i) {
+        a[i] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * srcStride));
+    }
+
+    for (int i = 0; i < 8; ++i) {
+        b[2 * i] = _mm_unpacklo_epi8(a[2 * i], a[2 * i + 1]);
+        b[2 * i + 1] = _mm_unpackhi_epi8(a[2 * i], a[2 * i + 1]);
+    }
+    for (int i = 0; i < 4; ++i) {
+        a[4 * i] = _mm_unpacklo_epi16(b[4 * i], b[4 * i + 2]);
+        a[4 * i + 1] = _mm_unpackhi_epi16(b[4 * i], b[4 * i + 2]);
+        a[4 * i + 2] = _mm_unpacklo_epi16(b[4 * i + 1], b[4 * i + 3]);
+        a[4 * i + 3] = _mm_unpackhi_epi16(b[4 * i + 1], b[4 * i + 3]);
+    }
+    for (int i = 0; i < 2; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            b[8 * i + 2 * j] = _mm_unpacklo_epi32(a[8 * i + j], a[8 * i + j + 4]);
+            b[8 * i + 2 * j + 1] = _mm_unpackhi_epi32(a[8 * i + j], a[8 * i + j + 4]);
+        }
+    }
+    for (int i = 0; i < 8; ++i) {
+        a[2 * i] = _mm_unpacklo_epi64(b[i], b[i + 8]);
+        a[2 * i + 1] = _mm_unpackhi_epi64(b[i], b[i + 8]);
+    }
+
+    for (int i = 0; i < 16; ++i) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i * dstStride), a[i]);
+    }
+}
+#endif
+
+// Transposes a packed plane, dst becomes height x width.
+void transposePlane(const uchar *src, uchar *dst, int width, int height)
+{
+    const int tileSize = 16;
+    for (int y0 = 0; y0 < height; y0 += tileSize) {
+        const int y1 = qMin(y0 + tileSize, height);
+        for (int x0 = 0; x0 < width; x0 += tileSize) {
+            const int x1 = qMin(x0 + tileSize, width);
+#if defined(__SSE2__)
+            if (x1 - x0 == tileSize && y1 - y0 == tileSize) {
+                transposeTileSse2(src + y0 * width + x0, width, dst + x0 * height + y0, height);
+                continue;
+            }
+#endif
+            for (int y = y0; y < y1; ++y) {
+                const uchar *in = src + y * width;
+                for (int x = x0; x < x1; ++x) {
+                    dst[x * height + y] = in[x];
+                }
+            }
+        }
+    }
+}
+
+void boxBlurAlpha(QVector<uchar> &plane, int width, int height, int radius, int numIterations)
+{
+    // The plane is transposed for horizontal passes so that both
+    // directions can use the same kernel.
+    QVector<uchar> tmp(plane.size());
 
     const QVector<int> boxSizes = computeBoxSizes(radius, numIterations);
     for (const int &boxSize : boxSizes) {
-        boxBlurPass(image, tmp, boxSize); // horizontal pass
-        boxBlurPass(tmp, image, boxSize); // vertical pass
+        // horizontal pass
+        transposePlane(plane.constData(), tmp.data(), width, height);
+        blurColumns(tmp.constData(), plane.data(), height, width, boxSize);
+
+        // vertical pass
+        transposePlane(plane.constData(), tmp.data(), height, width);
+        blurColumns(tmp.constData(), plane.data(), width, height, boxSize);
     }
 }
 
-void boxShadow(QPainter *p, const QRect &box, const QPoint &offset, int radius, const QColor &color)
+// Same as BYTE_MUL in qdrawhelper_p.h, so the result matches filling the
+// alpha mask with CompositionMode_SourceIn.
+inline QRgb multiplyPixel(QRgb pixel, uint alpha)
 {
-    const QSize size = box.size() + 2 * QSize(radius, radius);
-    const qreal dpr = p->device()->devicePixelRatioF();
+    uint t = (pixel & 0xff00ff) * alpha;
+    t = (t + ((t >> 8) & 0xff00ff) + 0x800080) >> 8;
+    t &= 0xff00ff;
 
-    QPainter painter;
+    pixel = ((pixel >> 8) & 0xff00ff) * alpha;
+    pixel = (pixel + ((pixel >> 8) & 0xff00ff) + 0x800080);
+    pixel &= 0xff00ff00;
 
-    QImage shadow(size * dpr, QImage::Format_ARGB32_Premultiplied);
-    shadow.setDevicePixelRatio(dpr);
-    shadow.fill(Qt::transparent);
+    return pixel | t;
+}
+
+void fillColorTable(QRgb *colorTable, const QColor &color)
+{
+    const QRgb premultiplied = qPremultiply(color.rgba());
+    for (uint alpha = 0; alpha < 256; ++alpha) {
+        colorTable[alpha] = multiplyPixel(premultiplied, alpha);
+    }
+}
+
+QImage colorizeAlpha(const QVector<uchar> &plane, int width, int height, const QColor &color)
+{
+    QRgb colorTable[256];
+    fillColorTable(colorTable, color);
+
+    QImage image(width, height, QImage::Format_ARGB32_Premultiplied);
+    for (int y = 0; y < height; ++y) {
+        const uchar *in = plane.constData() + y * width;
+        QRgb *out = reinterpret_cast<QRgb *>(image.scanLine(y));
+        for (int x = 0; x < width; ++x) {
+            out[x] = colorTable[in[x]];
+        }
+    }
+
+    return image;
+}
+
+// Blurs a unit step that covers [first, last) with the given boxes. Sums
+// are kept in integers and divided once at the end, so the profile is the
+// exact box convolution rather than an approximation of it.
+QVector<qreal> blurredStep(int length, int first, int last, const QVector<int> &boxSizes)
+{
+    QVector<qint64> profile(length, 0);
+    QVector<qint64> tmp(length);
+    for (int i = qMax(first, 0); i < qMin(last, length); ++i) {
+        profile[i] = 1;
+    }
+
+    qint64 scale = 1;
+    for (const int &boxSize : boxSizes) {
+        const int radius = boxSizeToRadius(boxSize);
+
+        qint64 window = 0;
+        for (int i = 0; i < qMin(radius, length); ++i) {
+            window += profile[i];
+        }
+
+        for (int i = 0; i < length; ++i) {
+            if (i + radius < length) {
+                window += profile[i + radius];
+            }
+            if (i > radius) {
+                window -= profile[i - radius - 1];
+            }
+            tmp[i] = window;
+        }
+
+        profile.swap(tmp);
+        scale *= boxSize;
+    }
+
+    QVector<qreal> result(length);
+    for (int i = 0; i < length; ++i) {
+        result[i] = static_cast<qreal>(profile[i]) / scale;
+    }
+
+    return result;
+}
+
+struct ShadowGeometry {
+    QSize deviceSize;
+    QRect deviceBox;
+    qreal dpr;
+};
 
-    painter.begin(&shadow);
-    painter.fillRect(QRect(QPoint(radius, radius), box.size()), Qt::black);
-    painter.end();
+ShadowGeometry shadowGeometry(QPainter *p, const QRect &box, int radius)
+{
+    const QSize size = box.size() + 2 * QSize(radius, radius);
 
-    // There is no need to blur RGB channels. Blur the alpha
-    // channel and then give the shadow a tint of the desired color.
-    const int numIterations = 3;
-    boxBlurAlpha(shadow, radius, numIterations);
+    ShadowGeometry geometry;
+    geometry.dpr = p->device()->devicePixelRatioF();
+    geometry.deviceSize = size * geometry.dpr;
+    geometry.deviceBox = QRectF(QPointF(radius, radius) * geometry.dpr, QSizeF(box.size()) * geometry.dpr)
+        .toRect()
+        .intersected(QRect(QPoint(0, 0), geometry.deviceSize));
+
+    return geometry;
+}
 
-    painter.begin(&shadow);
-    painter.setCompositionMode(QPainter::CompositionMode_SourceIn);
-    painter.fillRect(shadow.rect(), color);
-    painter.end();
+void drawShadow(QPainter *p, QImage &shadow, qreal dpr, const QRect &box, const QPoint &offset)
+{
+    shadow.setDevicePixelRatio(dpr);
 
     QRect shadowRect = shadow.rect();
     shadowRect.setSize(shadowRect.size() / dpr);
@@ -169,5 +504,92 @@ void boxShadow(QPainter *p, const QRect &box, const QPoint &offset, int radius,
     p->drawImage(shadowRect, shadow);
 }
 
+void boxShadow(QPainter *p, const QRect &box, const QPoint &offset, int radius, const QColor &color)
+{
+    const ShadowGeometry geometry = shadowGeometry(p, box, radius);
+    const int width = geometry.deviceSize.width();
+    const int height = geometry.deviceSize.height();
+    const QRect &deviceBox = geometry.deviceBox;
+
+    // A blurred axis-aligned box is separable: it is the product of the
+    // blurred horizontal and vertical steps. So there is no need to blur
+    // the whole texture, two 1D profiles are enough.
+    const QVector<int> boxSizes = computeBoxSizes(radius, BLUR_ITERATIONS);
+    QVector<qreal> columns = blurredStep(width, deviceBox.left(), deviceBox.right() + 1, boxSizes);
+    const QVector<qreal> rows = blurredStep(height, deviceBox.top(), deviceBox.bottom() + 1, boxSizes);
+    for (qreal &column : columns) {
+        column *= 255;
+    }
+
+    QRgb colorTable[256];
+    fillColorTable(colorTable, color);
+
+    QImage shadow(width, height, QImage::Format_ARGB32_Premultiplied);
+    for (int y = 0; y < height; ++y) {
+        const qreal row = rows[y];
+        QRgb *out = reinterpret_cast<QRgb *>(shadow.scanLine(y));
+        for (int x = 0; x < width; ++x) {
+            out[x] = colorTable[static_cast<int>(columns[x] * row + 0.5)];
+        }
+    }
+
+    drawShadow(p, shadow, geometry.dpr, box, offset);
+}
+
+void boxShadowReference(QPainter *p, const QRect &box, const QPoint &offset, int radius, const QColor &color)
+{
+    const ShadowGeometry geometry = shadowGeometry(p, box, radius);
+    const int width = geometry.deviceSize.width();
+    const int height = geometry.deviceSize.height();
+    const QRect &deviceBox = geometry.deviceBox;
+
+    // There is no need to blur RGB channels. Rasterize the box into an
+    // alpha plane, blur it and then give the shadow a tint of the desired
+    // color.
+    QVector<uchar> plane(width * height, 0);
+    for (int y = deviceBox.top(); y <= deviceBox.bottom(); ++y) {
+        std::memset(plane.data() + y * width + deviceBox.left(), 0xff, deviceBox.width());
+    }
+
+    boxBlurAlpha(plane, width, height, radius, BLUR_ITERATIONS);
+
+    QImage shadow = colorizeAlpha(plane, width, height, color);
+    drawShadow(p, shadow, geometry.dpr, box, offset);
+}
+
+bool setBlurKernel(BlurKernel kernel)
+{
+    BlurColumnsFunc func = nullptr;
+
+    switch (kernel) {
+    case BlurKernel::Auto:
+        break;
+    case BlurKernel::Scalar:
+        func = blurColumnsScalarAll;
+        break;
+    case BlurKernel::Sse2:
+#if defined(__SSE2__)
+        func = blurColumnsSse2;
+        break;
+#else
+        return false;
+#endif
+    case BlurKernel::Avx2:
+#if defined(BOXSHADOW_HAVE_AVX2)
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("avx2")) {
+            return false;
+        }
+        func = blurColumnsAvx2;
+        break;
+#else
+        return false;
+#endif
+    }
+
+    s_forcedBlurColumns.store(func, std::memory_order_relaxed);
+    return true;
+}
+
 } // namespace BoxShadowHelper
 } // namespace Material
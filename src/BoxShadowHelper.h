@@ -28,8 +28,27 @@ namespace Material
 namespace BoxShadowHelper
 {
 
+// Computes the shadow as the product of two blurred 1D step profiles.
 void boxShadow(QPainter *p, const QRect &box, const QPoint &offset,
                int radius, const QColor &color);
 
+// Rasterizes the box and blurs it as a whole. It is much slower than
+// boxShadow() and is kept only to check the fast path against.
+void boxShadowReference(QPainter *p, const QRect &box, const QPoint &offset,
+                        int radius, const QColor &color);
+
+// Blur kernels boxShadowReference() can use. By default the fastest
+// one the CPU supports is picked at runtime.
+enum class BlurKernel {
+    Auto,
+    Scalar,
+    Sse2,
+    Avx2,
+};
+
+// Forces a kernel, so that the kernels can be checked against each other.
+// Returns false if it isn't built in or the CPU lacks it.
+bool setBlurKernel(BlurKernel kernel);
+
 } // namespace BoxShadowHelper
 } // namespace Material
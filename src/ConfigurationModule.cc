@@ -192,6 +192,11 @@ void ConfigurationModule::init()
     menuAlwaysShowGroup->addButton(menuAlwaysShow);
     menuAlwaysShowGroup->addButton(menuRevealOnHover);
 
+    QCheckBox *menuPrefetch = new QCheckBox(menuTab);
+    menuPrefetch->setText(i18n("Load submenus in the background"));
+    menuPrefetch->setObjectName(QStringLiteral("kcfg_MenuPrefetch"));
+    menuForm->addRow(QStringLiteral(""), menuPrefetch);
+
 
     //--- Animations
     QWidget *animationsTab = new QWidget(tabWidget);
@@ -323,6 +328,12 @@ void ConfigurationModule::init()
         true,
         QStringLiteral("MenuAlwaysShow")
     );
+    skel->addItemBool(
+        QStringLiteral("MenuPrefetch"),
+        m_menuPrefetch,
+        true,
+        QStringLiteral("MenuPrefetch")
+    );
     skel->addItemBool(
         QStringLiteral("AnimationsEnabled"),
         m_animationsEnabled,
@@ -45,6 +45,7 @@ private:
     double m_activeOpacity;
     double m_inactiveOpacity;
     bool m_menuAlwaysShow;
+    bool m_menuPrefetch;
     bool m_animationsEnabled;
     int m_animationsDuration;
     int m_shadowSize;
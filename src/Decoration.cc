@@ -22,9 +22,15 @@
 #include "Decoration.h"
 #include "Material.h"
 #include "AppMenuButtonGroup.h"
+#include "AppMenuModel.h"
+#include "AppMenuWindowTracker.h"
 #include "BoxShadowHelper.h"
 #include "Button.h"
 #include "InternalSettings.h"
+#include "ShadowCache.h"
+#include "ShadowDiskCache.h"
+#include "SettingsProvider.h"
+#include "X11Atoms.h"
 
 // KDecoration
 #include <KDecoration2/DecoratedClient>
@@ -37,6 +43,8 @@
 #include <KColorUtils>
 #include <KSharedConfig>
 #include <KPluginFactory>
+#include <KWindowInfo>
+#include <KWindowSystem>
 
 // Qt
 
@@ -45,12 +53,20 @@
 #include <QVariantAnimation>
 #include <QFontDatabase>
 #include <QApplication>
+#include <QCache>
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QFutureWatcher>
+#include <QHash>
+#include <QtConcurrentRun>
 #include <QDebug>
 #include <QHoverEvent>
 #include <QMouseEvent>
 #include <QPainter>
 #include <QSharedPointer>
+#include <QTransform>
 #include <QWheelEvent>
+#include <QtMath>
 
 // X11
 #include <xcb/xcb.h>
@@ -145,13 +161,227 @@ inline CompositeShadowParams lookupShadowParams(int size)
     }
 }
 
+inline int maxShadowRadius(const CompositeShadowParams &params)
+{
+    return qMax(params.shadow1.radius, params.shadow2.radius);
+}
+
+QMargins shadowPadding(const CompositeShadowParams &params)
+{
+    const int size = maxShadowRadius(params);
+    return QMargins(
+        size - params.offset.x(),
+        size - params.offset.y(),
+        size + params.offset.x(),
+        size + params.offset.y());
+}
+
+QImage renderShadow(const CompositeShadowParams &params, const QColor &shadowColor, int shadowStrengthInt,
+                    qreal devicePixelRatio)
+{
+    auto withOpacity = [] (const QColor &color, qreal opacity) -> QColor {
+        QColor c(color);
+        c.setAlphaF(opacity);
+        return c;
+    };
+
+    const qreal shadowStrength = static_cast<qreal>(shadowStrengthInt) / 255.0;
+
+    // In order to properly render a box shadow with a given radius `shadowSize`,
+    // the box size should be at least `2 * QSize(shadowSize, shadowSize)`.
+    const int shadowSize = maxShadowRadius(params);
+    const QSize boxSize = QSize(1, 1) + QSize(shadowSize*2, shadowSize*2);
+    const QRect box(QPoint(shadowSize, shadowSize), boxSize);
+    const QRect rect = box.adjusted(-shadowSize, -shadowSize, shadowSize, shadowSize);
+
+    QImage shadowTexture(rect.size() * devicePixelRatio, QImage::Format_ARGB32_Premultiplied);
+    shadowTexture.setDevicePixelRatio(devicePixelRatio);
+    shadowTexture.fill(Qt::transparent);
+
+    QPainter painter(&shadowTexture);
+    painter.setRenderHint(QPainter::Antialiasing);
+
+    // Draw the "shape" shadow.
+    BoxShadowHelper::boxShadow(
+        &painter,
+        box,
+        params.shadow1.offset,
+        params.shadow1.radius,
+        withOpacity(shadowColor, params.shadow1.opacity * shadowStrength));
+
+    // Draw the "contrast" shadow.
+    BoxShadowHelper::boxShadow(
+        &painter,
+        box,
+        params.shadow2.offset,
+        params.shadow2.radius,
+        withOpacity(shadowColor, params.shadow2.opacity * shadowStrength));
+
+    // Mask out inner rect.
+    const QRect innerRect = rect - shadowPadding(params);
+
+    // Mask out window+titlebar from shadow
+    painter.setPen(Qt::NoPen);
+    painter.setBrush(Qt::black);
+    painter.setCompositionMode(QPainter::CompositionMode_DestinationOut);
+    painter.drawRect(innerRect);
+
+    painter.end();
+
+    return shadowTexture;
+}
+
+// Identifies a shadow texture in both the in-memory and the disk cache.
+QByteArray shadowCacheKey(const CompositeShadowParams &params, const QColor &shadowColor,
+                          int shadowStrength, qreal devicePixelRatio)
+{
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream << params.offset
+           << params.shadow1.offset << params.shadow1.radius << params.shadow1.opacity
+           << params.shadow2.offset << params.shadow2.radius << params.shadow2.opacity
+           << shadowColor.rgba() << shadowStrength << devicePixelRatio;
+
+    return QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+}
+
+// What each entry of InternalSettingsSchema.kcfg invalidates. Entries that
+// are not listed here redo everything.
+int settingsWork(const QString &key)
+{
+    static const QHash<QString, int> table = {
+        { QStringLiteral("ButtonSize"), GeometryWork },
+        { QStringLiteral("ButtonSpacing"), GeometryWork },
+        { QStringLiteral("TitleAlignment"), RepaintWork },
+        { QStringLiteral("ExtraTitleMargin"), RepaintWork },
+        { QStringLiteral("DrawBorderOnMaximizedWindows"), GeometryWork },
+        { QStringLiteral("DrawTitleBarSeparator"), RepaintWork },
+        { QStringLiteral("ButtonType"), GeometryWork },
+        { QStringLiteral("BackgroundOpacity"), RepaintWork },
+        { QStringLiteral("BorderSize"), GeometryWork },
+        { QStringLiteral("ActiveOpacity"), RepaintWork },
+        { QStringLiteral("InactiveOpacity"), RepaintWork },
+        { QStringLiteral("MenuAlwaysShow"), GeometryWork },
+        { QStringLiteral("MenuPrefetch"), MenuWork },
+        { QStringLiteral("AnimationsEnabled"), AnimationWork },
+        { QStringLiteral("AnimationsDuration"), AnimationWork },
+        { QStringLiteral("ShadowSize"), ShadowWork },
+        { QStringLiteral("ShadowColor"), ShadowWork },
+        { QStringLiteral("ShadowStrength"), ShadowWork },
+        { QStringLiteral("HideTitleBar"), GeometryWork },
+        { QStringLiteral("OpaqueTitleBar"), RepaintWork },
+        { QStringLiteral("OpacityOverride"), RepaintWork },
+        { QStringLiteral("FlatTitleBar"), RepaintWork },
+        { QStringLiteral("DrawBackgroundGradient"), RepaintWork },
+        { QStringLiteral("BackgroundGradientIntensity"), RepaintWork },
+        { QStringLiteral("TitleBarFont"), FontWork },
+        { QStringLiteral("TitleBarFontSize"), FontWork },
+    };
+    return table.value(key, AllWork);
+}
+
+// The title bar gradient only depends on these, so its rasterized pieces
+// can be shared by every decoration.
+struct TitleBarTilesKey
+{
+    QRgb color;
+    int height;
+    int intensity;
+    qreal devicePixelRatio;
+
+    bool operator==(const TitleBarTilesKey &other) const {
+        return color == other.color
+            && height == other.height
+            && intensity == other.intensity
+            && qFuzzyCompare(devicePixelRatio, other.devicePixelRatio);
+    }
+};
+
+inline uint qHash(const TitleBarTilesKey &key, uint seed = 0)
+{
+    return ::qHash(key.color, seed) ^ ::qHash(key.height) ^ ::qHash(key.intensity << 16)
+        ^ ::qHash(qRound(key.devicePixelRatio * 100));
+}
+
+struct TitleBarTiles
+{
+    QImage leftCorner;
+    QImage strip;
+    QImage rightCorner;
+};
+
+QLinearGradient titleBarGradient(const QColor &titleBarColor, int height, int intensity)
+{
+    QLinearGradient gradient( 0, 0, 0, height );
+    QColor lightCol( titleBarColor.lighter( 130 + intensity ) );
+    gradient.setColorAt(0.0, lightCol );
+    gradient.setColorAt(0.99 / static_cast<qreal>(height), lightCol );
+    gradient.setColorAt(1.0 / static_cast<qreal>(height), titleBarColor.lighter( 100 + intensity ) );
+    gradient.setColorAt(1.0, titleBarColor);
+    return gradient;
+}
+
+// Renders a title bar that is just wide enough for both rounded corners
+// and a one pixel wide column between them.
+TitleBarTiles renderTitleBarTiles(const QColor &titleBarColor, int height, int intensity, qreal devicePixelRatio)
+{
+    const int radius = Metrics::Frame_FrameRadius;
+    const QSize size(2 * radius + 1, height);
+
+    QImage image(size * devicePixelRatio, QImage::Format_ARGB32_Premultiplied);
+    image.setDevicePixelRatio(devicePixelRatio);
+    image.fill(Qt::transparent);
+
+    QPainter painter(&image);
+    painter.setRenderHint(QPainter::Antialiasing);
+    painter.setPen(Qt::NoPen);
+    painter.setBrush(titleBarGradient(titleBarColor, height, intensity));
+    // the rect is made a little bit larger to clip away the rounded corners at the bottom
+    painter.drawRoundedRect(QRect(QPoint(0, 0), size + QSize(0, radius)), radius, radius);
+    painter.end();
+
+    // The corners are cut at a whole device pixel, paintTitleBar() derives
+    // their logical width from the tiles rather than from the radius.
+    const int deviceRadius = qRound(radius * devicePixelRatio);
+
+    TitleBarTiles tiles;
+    tiles.leftCorner = image.copy(0, 0, deviceRadius, image.height());
+    tiles.strip = image.copy(deviceRadius, 0, 1, image.height());
+    tiles.rightCorner = image.copy(image.width() - deviceRadius, 0, deviceRadius, image.height());
+    tiles.leftCorner.setDevicePixelRatio(devicePixelRatio);
+    tiles.strip.setDevicePixelRatio(devicePixelRatio);
+    tiles.rightCorner.setDevicePixelRatio(devicePixelRatio);
+    return tiles;
+}
+
+QCache<TitleBarTilesKey, TitleBarTiles> s_titleBarTiles(16);
+
+TitleBarTiles titleBarTiles(const QColor &titleBarColor, int height, int intensity, qreal devicePixelRatio)
+{
+    const TitleBarTilesKey key{ titleBarColor.rgba(), height, intensity, devicePixelRatio };
+    if (const TitleBarTiles *tiles = s_titleBarTiles.object(key)) {
+        return *tiles;
+    }
+
+    TitleBarTiles *tiles = new TitleBarTiles(renderTitleBarTiles(titleBarColor, height, intensity, devicePixelRatio));
+    s_titleBarTiles.insert(key, tiles);
+    return *tiles;
+}
+
 } // anonymous namespace
 
 static int s_decoCount = 0;
-static int s_shadowSizePreset = InternalSettings::ShadowVeryLarge;
-static int s_shadowStrength = 255;
-static QColor s_shadowColor = QColor(33, 33, 33);
-static QSharedPointer<KDecoration2::DecorationShadow> s_cachedShadow;
+static ShadowCache s_shadowCache;
+static ShadowDiskCache s_shadowDiskCache;
+
+// Shadows that are being rendered on the thread pool, by cache key.
+struct ShadowWatcher : public QFutureWatcher<ShadowDiskCache::Entry>
+{
+    // Set once the job is done, before the waiting decorations are
+    // notified. The cache may have evicted it again by then.
+    QSharedPointer<KDecoration2::DecorationShadow> shadow;
+};
+static QHash<QByteArray, ShadowWatcher *> s_pendingShadows;
 
 Decoration::Decoration(QObject *parent, const QVariantList &args)
     : KDecoration2::Decoration(parent, args)
@@ -159,12 +389,31 @@ Decoration::Decoration(QObject *parent, const QVariantList &args)
     , m_animation( new QVariantAnimation( this ) )
 {
     ++s_decoCount;
+
+    // Intern the X11 atoms right away, so their replies are in by the
+    // time a window needs them.
+    X11Atoms::prefetch();
 }
 
 Decoration::~Decoration()
 {
+    if (m_geometryWindowId) {
+        AppMenuWindowTracker::unwatchGeometry(m_geometryWindowId, this);
+    }
+
     if (--s_decoCount == 0) {
-        s_cachedShadow.clear();
+        // The plugin may be unloaded right after the last decoration is
+        // gone, so don't leave any jobs behind.
+        for (ShadowWatcher *watcher : qAsConst(s_pendingShadows)) {
+            watcher->waitForFinished();
+            delete watcher;
+        }
+        s_pendingShadows.clear();
+        s_shadowCache.clear();
+        s_titleBarTiles.clear();
+        SettingsProvider::release();
+        AppMenuWindowTracker::release();
+        AppMenuModel::releaseSharedImporters();
     }
 }
 
@@ -230,9 +479,7 @@ QPair<QRect,Qt::Alignment> Decoration::captionRect() const
 
                 // full caption rect
                 const QRect fullRect = QRect( 0, yOffset, size().width(), captionHeight() );
-                QFont f; f.fromString(m_internalSettings->titleBarFont());
-                QFontMetrics fm(f);
-                QRect boundingRect( fm.boundingRect( c->caption()) );
+                QRect boundingRect( m_titleBarFontMetrics.boundingRect( c->caption() ).toAlignedRect() );
 
                 // text bounding rect
                 boundingRect.setTop( yOffset );
@@ -340,79 +587,82 @@ void Decoration::paintTitleBar(QPainter *painter, const QRect &repaintRegion)
 
     if ( !titleRect.intersects(repaintRegion) ) return;
 
-    painter->save();
-    painter->setPen(Qt::NoPen);
+    QColor titleBarColor( this->titleBarColor() );
+    titleBarColor.setAlpha(titleBarAlpha());
 
     // render a linear gradient on title area and draw a light border at the top
-    if( m_internalSettings->drawBackgroundGradient() && !flatTitleBar() )
-    {
-
-        QColor titleBarColor( this->titleBarColor() );
-        titleBarColor.setAlpha(titleBarAlpha());
-
-        QLinearGradient gradient( 0, 0, 0, titleRect.height() );
-        QColor lightCol( titleBarColor.lighter( 130 + m_internalSettings->backgroundGradientIntensity() ) );
-        gradient.setColorAt(0.0, lightCol );
-        gradient.setColorAt(0.99 / static_cast<qreal>(titleRect.height()), lightCol );
-        gradient.setColorAt(1.0 / static_cast<qreal>(titleRect.height()), titleBarColor.lighter( 100 + m_internalSettings->backgroundGradientIntensity() ) );
-        gradient.setColorAt(1.0, titleBarColor);
-
-        painter->setBrush(gradient);
-
-    } else {
-
-        QColor titleBarColor = this->titleBarColor();
-        titleBarColor.setAlpha(titleBarAlpha());
-
-        QLinearGradient gradient( 0, 0, 0, titleRect.height() );
-        QColor lightCol( titleBarColor.lighter( 130 ) );
-        gradient.setColorAt(0.0, lightCol );
-        gradient.setColorAt(0.99 / static_cast<qreal>(titleRect.height()), lightCol );
-        gradient.setColorAt(1.0 / static_cast<qreal>(titleRect.height()), titleBarColor );
-        gradient.setColorAt(1.0, titleBarColor);
-
-        painter->setBrush( gradient );
-
-    }
+    const int intensity = m_internalSettings->drawBackgroundGradient() && !flatTitleBar()
+        ? m_internalSettings->backgroundGradientIntensity()
+        : 0;
 
     auto s = settings();
-    if( isMaximized() || !s->isAlphaChannelSupported() )
-    {
-
-        painter->drawRect(titleRect);
+    const bool square = isMaximized() || !s->isAlphaChannelSupported();
 
-    } else if( c->isShaded() ) {
+    if( !square && c->isShaded() )
+    {
 
+        // the bottom corners are rounded as well, which is rare enough to
+        // not be worth caching
+        painter->save();
+        painter->setPen(Qt::NoPen);
+        painter->setBrush(titleBarGradient(titleBarColor, titleRect.height(), intensity));
         painter->drawRoundedRect(titleRect, Metrics::Frame_FrameRadius, Metrics::Frame_FrameRadius);
+        painter->restore();
+        return;
 
-    } else {
+    }
 
-        painter->setClipRect(titleRect, Qt::IntersectClip);
+    // The gradient is stretched from a one pixel wide strip and the rounded
+    // corners are blitted, so nothing has to be rasterized here. While the
+    // active color fades, every frame has a color of its own, so those
+    // tiles are rendered without polluting the cache.
+    const qreal devicePixelRatio = painter->device()->devicePixelRatioF();
+    const TitleBarTiles tiles = m_animation->state() == QAbstractAnimation::Running
+        ? renderTitleBarTiles(titleBarColor, titleRect.height(), intensity, devicePixelRatio)
+        : titleBarTiles(titleBarColor, titleRect.height(), intensity, devicePixelRatio);
 
-        // the rect is made a little bit larger to be able to clip away the rounded corners at the bottom and sides
-        painter->drawRoundedRect(titleRect.adjusted(
-            isLeftEdge() ? -Metrics::Frame_FrameRadius:0,
-            isTopEdge() ? -Metrics::Frame_FrameRadius:0,
-            isRightEdge() ? Metrics::Frame_FrameRadius:0,
-            Metrics::Frame_FrameRadius),
-            Metrics::Frame_FrameRadius, Metrics::Frame_FrameRadius);
+    // At fractional scales the corners are not a whole number of logical
+    // pixels wide, so the strip is fitted between them as they are.
+    const qreal cornerWidth = tiles.leftCorner.width() / devicePixelRatio;
+    const qreal leftWidth = (square || isLeftEdge() || isTopEdge()) ? 0 : cornerWidth;
+    const qreal rightWidth = (square || isRightEdge() || isTopEdge()) ? 0 : cornerWidth;
+    const qreal height = titleRect.height();
 
-    }
+    const qreal stripWidth = titleRect.width() - leftWidth - rightWidth;
 
-    painter->restore();
+    if( leftWidth > 0 ) painter->drawImage(QRectF(0, 0, leftWidth, height), tiles.leftCorner);
+    if( stripWidth > 0 ) painter->drawImage(QRectF(leftWidth, 0, stripWidth, height), tiles.strip);
+    if( rightWidth > 0 ) painter->drawImage(QRectF(titleRect.width() - rightWidth, 0, rightWidth, height), tiles.rightCorner);
 
 }
 
 void Decoration::paint(QPainter *painter, const QRect &repaintRegion)
 {
-        // TODO: optimize based on repaintRegion
         auto c = client().data();
         auto s = settings();
 
+        // The window is on an output with another scale than its shadow
+        // was rendered at. The shadow can't be replaced while painting.
+        const qreal devicePixelRatio = painter->device()->devicePixelRatioF();
+        if (!qFuzzyCompare(devicePixelRatio, m_devicePixelRatio)) {
+            m_devicePixelRatio = devicePixelRatio;
+            QMetaObject::invokeMethod(this, &Decoration::updateShadow, Qt::QueuedConnection);
+        }
+
+        // Elements that are completely outside of the damaged area are
+        // skipped, the ones that are only partially damaged get clipped.
+        const bool clipped = !repaintRegion.contains(rect());
+        if( clipped )
+        {
+            painter->save();
+            painter->setClipRect(repaintRegion, Qt::IntersectClip);
+        }
+
         // paint background
-        if( !c->isShaded() )
+        const QRect frameRect = hideTitleBar() ? rect() : rect().adjusted(0, borderTop(), 0, 0);
+        if( !c->isShaded() && frameRect.intersects(repaintRegion) )
         {
-            painter->fillRect(rect(), Qt::transparent);
+            painter->fillRect(rect().intersected(repaintRegion), Qt::transparent);
             painter->save();
             painter->setRenderHint(QPainter::Antialiasing);
             painter->setPen(Qt::NoPen);
@@ -432,7 +682,9 @@ void Decoration::paint(QPainter *painter, const QRect &repaintRegion)
 
         if( !hideTitleBar() ) paintTitleBar(painter, repaintRegion);
 
-        if( hasBorders() && !s->isAlphaChannelSupported() )
+        // the outline only covers the outermost pixels
+        const bool outlineDamaged = !rect().adjusted(1, 1, -1, -1).contains(repaintRegion);
+        if( hasBorders() && !s->isAlphaChannelSupported() && outlineDamaged )
         {
             painter->save();
             painter->setRenderHint(QPainter::Antialiasing, false);
@@ -446,13 +698,19 @@ void Decoration::paint(QPainter *painter, const QRect &repaintRegion)
         }
 
         paintButtons(painter, repaintRegion);
-        paintCaption(painter, repaintRegion);
+        if( titleBarRect().intersects(repaintRegion) ) paintCaption(painter, repaintRegion);
+
+        if( clipped ) painter->restore();
 
 }
 
 void Decoration::init()
 {
-    m_internalSettings = QSharedPointer<InternalSettings>(new InternalSettings());
+    // Connected before any button exists, so that buttons see the new
+    // settings when they are reconfigured.
+    SettingsProvider::self()->watch(settings().data());
+    updateInternalSettings();
+    updateTitleBarFont();
 
     auto *decoratedClient = client().toStrongRef().data();
 
@@ -480,6 +738,19 @@ void Decoration::init()
     m_menuButtons->updateAppMenuModel();
 
 
+    // KDecoration doesn't tell us about moves, see windowPos().
+    connect(decoratedClient, &KDecoration2::DecoratedClient::widthChanged,
+            this, &Decoration::invalidateWindowPos);
+    connect(decoratedClient, &KDecoration2::DecoratedClient::heightChanged,
+            this, &Decoration::invalidateWindowPos);
+    connect(this, &KDecoration2::Decoration::bordersChanged,
+            this, &Decoration::invalidateWindowPos);
+    // Moves by KWin only reach us as a geometry change of the client.
+    if (KWindowSystem::isPlatformX11()) {
+        m_geometryWindowId = decoratedClient->windowId();
+        AppMenuWindowTracker::self()->watchGeometry(m_geometryWindowId, this);
+    }
+
     connect(decoratedClient, &KDecoration2::DecoratedClient::widthChanged,
             this, &Decoration::updateTitleBar);
     connect(decoratedClient, &KDecoration2::DecoratedClient::widthChanged,
@@ -498,6 +769,13 @@ void Decoration::init()
 
     connect(decoratedClient, &KDecoration2::DecoratedClient::captionChanged,
             this, repaintTitleBar);
+    connect(decoratedClient, &KDecoration2::DecoratedClient::captionChanged,
+            this, [this] {
+                // Title exceptions are the only settings that depend on the caption.
+                if (SettingsProvider::self()->exceptions().hasTitleExceptions() && updateInternalSettings()) {
+                    applySettingsWork(AllWork);
+                }
+            });
     connect(decoratedClient, &KDecoration2::DecoratedClient::activeChanged,
             this, repaintTitleBar);
 
@@ -511,13 +789,13 @@ void Decoration::init()
     updateTitleBarHoverState();
 
     // For some reason, the shadow should be installed the last. Otherwise,
-    // the Window Decorations KCM crashes.
+    // the Window Decorations KCM crashes. Until the decoration is painted,
+    // the output it is on is not known.
+    m_devicePixelRatio = qApp->devicePixelRatio();
     updateShadow();
 
-    connect(settings().data(), &KDecoration2::DecorationSettings::reconfigured,
-        this, &Decoration::reconfigure);
-    connect(m_internalSettings.data(), &InternalSettings::configChanged,
-        this, &Decoration::reconfigure);
+    connect(SettingsProvider::self(), &SettingsProvider::settingsChanged,
+        this, &Decoration::onSettingsChanged);
 
     // Window Decoration KCM
     // The reconfigure signal will update active windows, but we need to hook
@@ -526,21 +804,88 @@ void Decoration::init()
         this, &Decoration::updateBorders);
     connect(settings().data(), &KDecoration2::DecorationSettings::fontChanged,
         this, &Decoration::updateBorders);
+    connect(settings().data(), &KDecoration2::DecorationSettings::fontChanged,
+        this, &Decoration::updateTitleBarFont);
     connect(settings().data(), &KDecoration2::DecorationSettings::spacingChanged,
         this, &Decoration::updateBorders);
 }
 
-void Decoration::reconfigure()
+void Decoration::onSettingsChanged(const QSet<QString> &changedKeys)
 {
-    m_internalSettings->load();
+    updateInternalSettings();
 
-    updateBorders();
-    updateTitleBar();
-    m_menuButtons->setAlwaysShow(m_internalSettings->menuAlwaysShow());
-    updateButtonsGeometry();
-    updateButtonAnimation();
-    updateShadow();
-    update();
+    int work = NoWork;
+    for (const QString &key : changedKeys) {
+        work |= settingsWork(key);
+    }
+    applySettingsWork(work);
+}
+
+bool Decoration::updateInternalSettings()
+{
+    // The class of a window never changes, so it is fetched only once and
+    // only if some exception needs it.
+    if (!m_windowClassFetched && SettingsProvider::self()->exceptions().hasClassExceptions()) {
+        m_windowClassFetched = true;
+        if (KWindowSystem::isPlatformX11()) {
+            const KWindowInfo info(client().data()->windowId(), NET::Properties(), NET::WM2WindowClass);
+            m_windowClass = QString::fromUtf8(info.windowClassName())
+                + QLatin1Char(' ')
+                + QString::fromUtf8(info.windowClassClass());
+        }
+    }
+
+    const InternalSettingsPtr internalSettings = SettingsProvider::self()->internalSettings(
+        m_windowClass, client().data()->caption());
+    if (internalSettings == m_internalSettings) {
+        return false;
+    }
+
+    m_internalSettings = internalSettings;
+    return true;
+}
+
+void Decoration::applySettingsWork(int work)
+{
+    for (int flag = GeometryWork; flag <= MenuWork; flag <<= 1) {
+        if (work & flag) {
+            ++m_settingsWorkCounters[flag];
+        }
+    }
+
+    if (work & FontWork) {
+        updateTitleBarFont();
+    }
+    if (work & GeometryWork) {
+        updateBorders();
+        updateTitleBar();
+        m_menuButtons->setAlwaysShow(m_internalSettings->menuAlwaysShow());
+        updateButtonsGeometry();
+    }
+    if (work & AnimationWork) {
+        updateButtonAnimation();
+    }
+    if (work & MenuWork) {
+        m_menuButtons->setMenuPrefetch(m_internalSettings->menuPrefetch());
+    }
+    if (work & ShadowWork) {
+        updateShadow();
+    }
+    if (work & (GeometryWork | RepaintWork | FontWork)) {
+        update();
+    }
+}
+
+QVariantMap Decoration::settingsWorkCounters() const
+{
+    return {
+        { QStringLiteral("geometry"), m_settingsWorkCounters.value(GeometryWork) },
+        { QStringLiteral("shadow"), m_settingsWorkCounters.value(ShadowWork) },
+        { QStringLiteral("repaint"), m_settingsWorkCounters.value(RepaintWork) },
+        { QStringLiteral("font"), m_settingsWorkCounters.value(FontWork) },
+        { QStringLiteral("animation"), m_settingsWorkCounters.value(AnimationWork) },
+        { QStringLiteral("menu"), m_settingsWorkCounters.value(MenuWork) },
+    };
 }
 
 void Decoration::mousePressEvent(QMouseEvent *event)
@@ -849,87 +1194,122 @@ void Decoration::updateShadow()
 {
     const QColor shadowColor = m_internalSettings->shadowColor();
     const int shadowStrengthInt = m_internalSettings->shadowStrength();
-    const int shadowSizePreset = m_internalSettings->shadowSize();
-
-    if (!s_cachedShadow.isNull()
-        && s_shadowColor == shadowColor
-        && s_shadowSizePreset == shadowSizePreset
-        && s_shadowStrength == shadowStrengthInt
-    ) {
-        setShadow(s_cachedShadow);
-        return;
-    }
-
-    s_shadowColor = shadowColor;
-    s_shadowStrength = shadowStrengthInt;
-    s_shadowSizePreset = shadowSizePreset;
-
-    auto withOpacity = [] (const QColor &color, qreal opacity) -> QColor {
-        QColor c(color);
-        c.setAlphaF(opacity);
-        return c;
-    };
-
-    const qreal shadowStrength = static_cast<qreal>(shadowStrengthInt) / 255.0;
-    const CompositeShadowParams params = lookupShadowParams(shadowSizePreset);
+    const CompositeShadowParams params = lookupShadowParams(m_internalSettings->shadowSize());
 
     if (params.isNone()) { // InternalSettings::ShadowNone
-        s_cachedShadow.clear();
-        setShadow(s_cachedShadow);
+        m_shadowCacheKey.clear();
+        setShadow(QSharedPointer<KDecoration2::DecorationShadow>());
         return;
     }
 
-    // In order to properly render a box shadow with a given radius `shadowSize`,
-    // the box size should be at least `2 * QSize(shadowSize, shadowSize)`.
-    const int shadowSize = qMax(params.shadow1.radius, params.shadow2.radius);
-    const QSize boxSize = QSize(1, 1) + QSize(shadowSize*2, shadowSize*2);
-    const QRect box(QPoint(shadowSize, shadowSize), boxSize);
-    const QRect rect = box.adjusted(-shadowSize, -shadowSize, shadowSize, shadowSize);
-
-    QImage shadowTexture(rect.size(), QImage::Format_ARGB32_Premultiplied);
-    shadowTexture.fill(Qt::transparent);
+    const qreal devicePixelRatio = m_devicePixelRatio;
+    const QByteArray cacheKey = shadowCacheKey(params, shadowColor, shadowStrengthInt, devicePixelRatio);
+    m_shadowCacheKey = cacheKey;
 
-    QPainter painter(&shadowTexture);
-    painter.setRenderHint(QPainter::Antialiasing);
+    const QSharedPointer<KDecoration2::DecorationShadow> shadow = s_shadowCache.shadow(cacheKey);
+    if (!shadow.isNull()) {
+        setShadow(shadow);
+        return;
+    }
 
-    // Draw the "shape" shadow.
-    BoxShadowHelper::boxShadow(
-        &painter,
-        box,
-        params.shadow1.offset,
-        params.shadow1.radius,
-        withOpacity(shadowColor, params.shadow1.opacity * shadowStrength));
+    // Rendering the texture doesn't need the compositor thread. Until it is
+    // done, the window keeps its current shadow, or has none if it was just
+    // mapped. Decorations that ask for the same shadow share a single job.
+    ShadowWatcher *watcher = s_pendingShadows.value(cacheKey);
+    if (!watcher) {
+        watcher = new ShadowWatcher();
+        s_pendingShadows.insert(cacheKey, watcher);
+
+        // Connected before any decoration, so the shadow is built by the
+        // time they are notified.
+        connect(watcher, &ShadowWatcher::finished, watcher, [watcher, cacheKey] {
+            const ShadowDiskCache::Entry entry = watcher->result();
+
+            auto shadow = QSharedPointer<KDecoration2::DecorationShadow>::create();
+            shadow->setPadding(entry.padding);
+            shadow->setInnerShadowRect(QRect(entry.image.rect().center(), QSize(1, 1)));
+            shadow->setShadow(entry.image);
+            s_shadowCache.insert(cacheKey, shadow);
+            watcher->shadow = shadow;
+
+            s_pendingShadows.remove(cacheKey);
+            watcher->deleteLater();
+        });
+
+        watcher->setFuture(QtConcurrent::run([params, shadowColor, shadowStrengthInt, devicePixelRatio, cacheKey] {
+            ShadowDiskCache::Entry entry = s_shadowDiskCache.load(cacheKey);
+            if (entry.isNull()) {
+                // The padding is in pixels of the texture, like the inner
+                // shadow rect.
+                entry.image = renderShadow(params, shadowColor, shadowStrengthInt, devicePixelRatio);
+                entry.padding = shadowPadding(params) * devicePixelRatio;
+                s_shadowDiskCache.store(cacheKey, entry.image, entry.padding);
+            }
+            return entry;
+        }));
+    }
 
-    // Draw the "contrast" shadow.
-    BoxShadowHelper::boxShadow(
-        &painter,
-        box,
-        params.shadow2.offset,
-        params.shadow2.radius,
-        withOpacity(shadowColor, params.shadow2.opacity * shadowStrength));
+    connect(watcher, &ShadowWatcher::finished, this, [this, watcher, cacheKey] {
+        // The settings may have changed while the shadow was rendered.
+        if (m_shadowCacheKey == cacheKey) {
+            setShadow(watcher->shadow);
+        }
+    });
+}
 
-    // Mask out inner rect.
-    const QMargins padding = QMargins(
-        shadowSize - params.offset.x(),
-        shadowSize - params.offset.y(),
-        shadowSize + params.offset.x(),
-        shadowSize + params.offset.y());
-    const QRect innerRect = rect - padding;
+void Decoration::updateTitleBarFont()
+{
+    // Parsing the font and looking up its style is too slow to be done
+    // on every paint, captions of some windows change all the time.
+    QFont f;
+    f.fromString(m_internalSettings->titleBarFont());
+    // KDE needs this FIXME: Why?
+    QFontDatabase fd;
+    f.setStyleName(fd.styleString(f));
 
-    // Mask out window+titlebar from shadow
-    painter.setPen(Qt::NoPen);
-    painter.setBrush(Qt::black);
-    painter.setCompositionMode(QPainter::CompositionMode_DestinationOut);
-    painter.drawRect(innerRect);
+    m_titleBarFont = f;
+    m_titleBarFontMetrics = QFontMetricsF(f);
+    m_captionLayout = CaptionLayout();
+}
 
-    painter.end();
+int Decoration::captionWidth(const QString &caption) const
+{
+    if (m_captionLayout.caption != caption) {
+        m_captionLayout = CaptionLayout();
+        m_captionLayout.caption = caption;
+        m_captionLayout.width = qCeil(m_titleBarFontMetrics.boundingRect(caption).width());
+    }
+    return m_captionLayout.width;
+}
 
-    s_cachedShadow = QSharedPointer<KDecoration2::DecorationShadow>::create();
-    s_cachedShadow->setPadding(padding);
-    s_cachedShadow->setInnerShadowRect(QRect(shadowTexture.rect().center(), QSize(1, 1)));
-    s_cachedShadow->setShadow(shadowTexture);
+const QStaticText &Decoration::captionText(const QSize &size, Qt::Alignment alignment, QPointF *offset) const
+{
+    // Repaints caused by hover or animations leave the caption alone, so
+    // it doesn't have to be elided and shaped again.
+    CaptionLayout &layout = m_captionLayout;
+    if (!layout.laidOut || layout.size != size || layout.alignment != alignment) {
+        const QString elided = m_titleBarFontMetrics.elidedText(layout.caption, Qt::ElideMiddle, size.width());
+
+        layout.laidOut = true;
+        layout.size = size;
+        layout.alignment = alignment;
+        layout.text.setText(elided);
+        layout.text.setTextFormat(Qt::PlainText);
+        layout.text.setPerformanceHint(QStaticText::AggressiveCaching);
+        layout.text.prepare(QTransform(), m_titleBarFont);
+
+        const QSizeF textSize = layout.text.size();
+        qreal x = 0;
+        if (alignment & Qt::AlignRight) {
+            x = size.width() - textSize.width();
+        } else if (alignment & Qt::AlignHCenter) {
+            x = (size.width() - textSize.width()) / 2;
+        }
+        layout.offset = QPointF(x, (size.height() - textSize.height()) / 2);
+    }
 
-    setShadow(s_cachedShadow);
+    *offset = layout.offset;
+    return layout.text;
 }
 
 bool Decoration::menuAlwaysShow() const
@@ -937,6 +1317,11 @@ bool Decoration::menuAlwaysShow() const
     return m_internalSettings->menuAlwaysShow();
 }
 
+bool Decoration::menuPrefetch() const
+{
+    return m_internalSettings->menuPrefetch();
+}
+
 bool Decoration::animationsEnabled() const
 {
     return m_internalSettings->animationsEnabled();
@@ -1056,6 +1441,10 @@ template <typename T> using ScopedPointer = QScopedPointer<T, QScopedPointerPodD
 
 QPoint Decoration::windowPos() const
 {
+    if (m_windowPosValid) {
+        return m_windowPos;
+    }
+
     const auto *decoratedClient = client().toStrongRef().data();
     WId windowId = decoratedClient->windowId();
 
@@ -1065,23 +1454,26 @@ QPoint Decoration::windowPos() const
     need to use xcb because the embedding of the widget
     breaks QT's mapToGlobal and other methods
     */
+    // KWin reparents clients with a zero border width, so a single
+    // translation against the root window is enough.
     auto connection( QX11Info::connection() );
-    xcb_get_geometry_cookie_t cookie( xcb_get_geometry( connection, windowId ) );
-    ScopedPointer<xcb_get_geometry_reply_t> reply( xcb_get_geometry_reply( connection, cookie, nullptr ) );
-    if (reply) {
-        // translate coordinates
-        xcb_translate_coordinates_cookie_t coordCookie( xcb_translate_coordinates(
-            connection, windowId, reply.data()->root,
-            -reply.data()->border_width,
-            -reply.data()->border_width ) );
-
-        ScopedPointer< xcb_translate_coordinates_reply_t> coordReply( xcb_translate_coordinates_reply( connection, coordCookie, nullptr ) );
-
-        if (coordReply) {
-            return QPoint(coordReply.data()->dst_x, coordReply.data()->dst_y);
-        }
+    xcb_translate_coordinates_cookie_t coordCookie( xcb_translate_coordinates(
+        connection, windowId, QX11Info::appRootWindow(), 0, 0 ) );
+
+    ScopedPointer< xcb_translate_coordinates_reply_t> coordReply( xcb_translate_coordinates_reply( connection, coordCookie, nullptr ) );
+
+    if (!coordReply) {
+        return QPoint(0, 0);
     }
-    return QPoint(0, 0);
+
+    m_windowPos = QPoint(coordReply.data()->dst_x, coordReply.data()->dst_y);
+    m_windowPosValid = true;
+    return m_windowPos;
+}
+
+void Decoration::invalidateWindowPos() const
+{
+    m_windowPosValid = false;
 }
 
 void Decoration::initDragMove(const QPoint pos)
@@ -1120,19 +1512,16 @@ void Decoration::sendMoveEvent(const QPoint pos)
         - QPoint(0, titleBarHeight())
         + pos;
 
+    // The window manager is about to move the window.
+    invalidateWindowPos();
+
     //--- From: BreezeSizeGrip.cpp
     auto connection(QX11Info::connection());
 
 
     // move/resize atom
-    if (!m_moveResizeAtom) {
-        // create atom if not found
-        const QString atomName( "_NET_WM_MOVERESIZE" );
-        xcb_intern_atom_cookie_t cookie( xcb_intern_atom( connection, false, atomName.size(), qPrintable( atomName ) ) );
-        ScopedPointer<xcb_intern_atom_reply_t> reply( xcb_intern_atom_reply( connection, cookie, nullptr ) );
-        m_moveResizeAtom = reply ? reply->atom : 0;
-    }
-    if (!m_moveResizeAtom) {
+    const xcb_atom_t moveResizeAtom = X11Atoms::atom(X11Atoms::NetWmMoveResize);
+    if (!moveResizeAtom) {
         return;
     }
 
@@ -1167,7 +1556,7 @@ void Decoration::sendMoveEvent(const QPoint pos)
     memset(&clientMessageEvent, 0, sizeof(clientMessageEvent));
 
     clientMessageEvent.response_type = XCB_CLIENT_MESSAGE;
-    clientMessageEvent.type = m_moveResizeAtom;
+    clientMessageEvent.type = moveResizeAtom;
     clientMessageEvent.format = 32;
     clientMessageEvent.window = windowId;
     clientMessageEvent.data.data32[0] = globalPos.x();
@@ -1257,7 +1646,8 @@ void Decoration::paintCaption(QPainter *painter, const QRect &repaintRegion) con
 
     const auto *decoratedClient = client().toStrongRef().data();
 
-    const int textWidth = settings()->fontMetrics().boundingRect(decoratedClient->caption()).width();
+    const QString caption = decoratedClient->caption();
+    const int textWidth = captionWidth(caption);
     const QRect textRect((size().width() - textWidth) / 2, 0, textWidth, titleBarHeight());
 
     const bool appMenuVisible = !m_menuButtons->buttons().isEmpty();
@@ -1305,8 +1695,8 @@ void Decoration::paintCaption(QPainter *painter, const QRect &repaintRegion) con
             break;
     }
 
-    const QString caption = painter->fontMetrics().elidedText(
-        decoratedClient->caption(), Qt::ElideMiddle, captionRect.width());
+    QPointF captionOffset;
+    const QStaticText &captionText = this->captionText(captionRect.size(), alignment, &captionOffset);
 
     painter->save();
     painter->setFont(settings()->font());
@@ -1344,20 +1734,31 @@ void Decoration::paintCaption(QPainter *painter, const QRect &repaintRegion) con
         }
     }
     // draw caption
-    QFont f; f.fromString(m_internalSettings->titleBarFont());
-    // KDE needs this FIXME: Why?
-    QFontDatabase fd; f.setStyleName(fd.styleString(f));
-    painter->setFont(f);
+    painter->setFont(m_titleBarFont);
     painter->setPen( fontColor() );
-    painter->drawText(captionRect, alignment, caption);
+    painter->drawStaticText(captionRect.topLeft() + captionOffset, captionText);
     painter->restore();
 }
 
 void Decoration::paintButtons(QPainter *painter, const QRect &repaintRegion) const
 {
-    m_leftButtons->paint(painter, repaintRegion);
-    m_rightButtons->paint(painter, repaintRegion);
-    m_menuButtons->paint(painter, repaintRegion);
+    // DecorationButtonGroup::paint() paints every button, even when only
+    // one of them is being animated.
+    const auto paintGroup = [painter, &repaintRegion] (KDecoration2::DecorationButtonGroup *group) {
+        if (!group->geometry().toAlignedRect().intersects(repaintRegion)) {
+            return;
+        }
+        const auto buttons = group->buttons();
+        for (const QPointer<KDecoration2::DecorationButton> &button : buttons) {
+            if (button->isVisible() && button->geometry().toAlignedRect().intersects(repaintRegion)) {
+                button->paint(painter, repaintRegion);
+            }
+        }
+    };
+
+    paintGroup(m_leftButtons);
+    paintGroup(m_rightButtons);
+    paintGroup(m_menuButtons);
 }
 
 void Decoration::paintOutline(QPainter *painter, const QRect &repaintRegion) const
@@ -21,6 +21,7 @@
 // own
 #include "AppMenuButtonGroup.h"
 #include "InternalSettings.h"
+#include "SettingsProvider.h"
 
 // KDecoration
 #include <KDecoration2/Decoration>
@@ -30,10 +31,14 @@
 #include <KDecoration2/DecorationButtonGroup>
 
 // Qt
+#include <QFont>
+#include <QFontMetricsF>
+#include <QHash>
 #include <QHoverEvent>
 #include <QMouseEvent>
 #include <QRectF>
 #include <QSharedPointer>
+#include <QStaticText>
 #include <QWheelEvent>
 #include <QVariant>
 
@@ -55,6 +60,19 @@ enum ExceptionMask
     BorderSize = 1<<4
 };
 
+//* work that has to be redone after a settings entry changed
+enum SettingsWork
+{
+    NoWork = 0,
+    GeometryWork = 1<<0,
+    ShadowWork = 1<<1,
+    RepaintWork = 1<<2,
+    FontWork = 1<<3,
+    AnimationWork = 1<<4,
+    MenuWork = 1<<5,
+    AllWork = GeometryWork|ShadowWork|RepaintWork|FontWork|AnimationWork|MenuWork
+};
+
 //* metrics
 enum Metrics
 {
@@ -87,9 +105,11 @@ public:
 
     void paint(QPainter *painter, const QRect &repaintRegion) override;
 
+    //* how many times each kind of SettingsWork was done, for debugging
+    Q_INVOKABLE QVariantMap settingsWorkCounters() const;
+
 public slots:
     void init() override;
-    void reconfigure();
 
 protected:
     void hoverEnterEvent(QHoverEvent *event) override;
@@ -101,6 +121,7 @@ protected:
 
 private slots:
     void onSectionUnderMouseChanged(const Qt::WindowFrameSection value);
+    void onSettingsChanged(const QSet<QString> &changedKeys);
 
 private:
     void updateBorders();
@@ -113,8 +134,14 @@ private:
     void setButtonGroupAnimation(KDecoration2::DecorationButtonGroup *buttonGroup, bool enabled, int duration);
     void updateButtonAnimation();
     void updateShadow();
+    void updateTitleBarFont();
+    bool updateInternalSettings();
+    void applySettingsWork(int work);
+    int captionWidth(const QString &caption) const;
+    const QStaticText &captionText(const QSize &size, Qt::Alignment alignment, QPointF *offset) const;
 
     bool menuAlwaysShow() const;
+    bool menuPrefetch() const;
     bool animationsEnabled() const;
     int animationsDuration() const;
     int buttonPadding() const;
@@ -132,7 +159,10 @@ private:
 
     bool titleBarIsHovered() const;
     int getTextWidth(const QString text, bool showMnemonic = false) const;
+    //* root position of the client, cached until invalidateWindowPos()
     QPoint windowPos() const;
+    //* the window may have moved, e.g. once an app menu is closed
+    void invalidateWindowPos() const;
 
     void initDragMove(const QPoint pos);
     void resetDragMove();
@@ -200,10 +230,43 @@ private:
     KDecoration2::DecorationButtonGroup *m_rightButtons;
     AppMenuButtonGroup *m_menuButtons;
 
-    QSharedPointer<InternalSettings> m_internalSettings;
+    InternalSettingsPtr m_internalSettings;
 
     QPoint m_pressedPoint;
-    xcb_atom_t m_moveResizeAtom = 0;
+    mutable QPoint m_windowPos;
+    mutable bool m_windowPosValid = false;
+    //* the client registered with AppMenuWindowTracker::watchGeometry()
+    WId m_geometryWindowId = 0;
+
+    //* WM_CLASS as "name class", used to match exceptions
+    QString m_windowClass;
+    bool m_windowClassFetched = false;
+
+    //* see settingsWorkCounters()
+    QHash<int, int> m_settingsWorkCounters;
+
+    //* key of the shadow this decoration wants, it may still be rendered
+    QByteArray m_shadowCacheKey;
+    //* of the output the decoration was last painted on, the shadow is rendered at it
+    qreal m_devicePixelRatio = 1;
+
+    //* caption font, parsed from the settings in updateTitleBarFont()
+    QFont m_titleBarFont;
+    QFontMetricsF m_titleBarFontMetrics = QFontMetricsF(QFont());
+
+    //* shaped caption, reused until the caption, font, size or alignment change
+    struct CaptionLayout
+    {
+        QString caption;
+        int width = 0;
+
+        bool laidOut = false;
+        QSize size;
+        Qt::Alignment alignment;
+        QStaticText text;
+        QPointF offset;
+    };
+    mutable CaptionLayout m_captionLayout;
 
     friend class AppMenuButtonGroup;
     friend class Button;
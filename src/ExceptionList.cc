@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2020 Chris Holland <zrenfire@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// own
+#include "ExceptionList.h"
+#include "Material.h"
+
+// KF
+#include <KConfigGroup>
+
+
+namespace Material
+{
+
+ExceptionList::ExceptionList(const KSharedConfig::Ptr &config)
+{
+    for (int index = 0; config->hasGroup(groupName(index)); ++index) {
+        const QString group = groupName(index);
+        const KConfigGroup exceptionGroup = config->group(group);
+        m_entries.append(exceptionGroup.entryMap());
+
+        // Start from the regular settings and read the entries that the
+        // exception overrides from its own group.
+        InternalSettings *settings = new InternalSettings();
+        const KConfigSkeletonItem::List items = settings->items();
+        for (KConfigSkeletonItem *item : items) {
+            if (exceptionGroup.hasKey(item->key())) {
+                const QString defaultGroup = item->group();
+                item->setGroup(group);
+                item->readConfig(config.data());
+                item->setGroup(defaultGroup);
+            }
+        }
+
+        Exception exception;
+        exception.settings = InternalSettingsPtr(settings);
+        exception.pattern = settings->exceptionPattern();
+
+        if (!settings->enabled() || exception.pattern.isEmpty()) {
+            continue;
+        }
+
+        // Most patterns are plain window classes, those don't need a
+        // regular expression at all.
+        exception.literal = QRegularExpression::escape(exception.pattern) == exception.pattern;
+        if (!exception.literal) {
+            exception.regularExpression.setPattern(exception.pattern);
+            if (!exception.regularExpression.isValid()) {
+                qCWarning(category) << "Invalid pattern in" << group << exception.regularExpression.errorString();
+                continue;
+            }
+            exception.regularExpression.optimize();
+        }
+
+        const int exceptionIndex = m_exceptions.size();
+        if (settings->exceptionType() == InternalSettings::ExceptionWindowTitle) {
+            m_titleExceptions.append(exceptionIndex);
+        } else {
+            m_classExceptions.append(exceptionIndex);
+        }
+        m_exceptions.append(exception);
+    }
+}
+
+InternalSettingsPtr ExceptionList::match(const QString &windowClass, const QString &caption) const
+{
+    const int classMatch = hasClassExceptions() ? matchClass(windowClass) : -1;
+    const int titleMatch = hasTitleExceptions() ? matchTitle(caption) : -1;
+
+    int index = -1;
+    if (classMatch < 0 || titleMatch < 0) {
+        index = qMax(classMatch, titleMatch);
+    } else {
+        index = qMin(classMatch, titleMatch);
+    }
+
+    return index < 0 ? InternalSettingsPtr() : m_exceptions.at(index).settings;
+}
+
+bool ExceptionList::hasSameEntries(const ExceptionList &other) const
+{
+    return m_entries == other.m_entries;
+}
+
+bool ExceptionList::Exception::matches(const QString &value) const
+{
+    if (literal) {
+        return value.contains(pattern);
+    }
+    return regularExpression.match(value).hasMatch();
+}
+
+QString ExceptionList::groupName(int index)
+{
+    return QStringLiteral("Windeco Exception %1").arg(index);
+}
+
+int ExceptionList::matchClass(const QString &windowClass) const
+{
+    const auto it = m_classMatches.constFind(windowClass);
+    if (it != m_classMatches.constEnd()) {
+        return it.value();
+    }
+
+    int result = -1;
+    for (const int index : m_classExceptions) {
+        if (m_exceptions.at(index).matches(windowClass)) {
+            result = index;
+            break;
+        }
+    }
+
+    m_classMatches.insert(windowClass, result);
+    return result;
+}
+
+int ExceptionList::matchTitle(const QString &caption) const
+{
+    for (const int index : m_titleExceptions) {
+        if (m_exceptions.at(index).matches(caption)) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+} // namespace Material
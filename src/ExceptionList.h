@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2020 Chris Holland <zrenfire@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// own
+#include "InternalSettings.h"
+
+// KF
+#include <KSharedConfig>
+
+// Qt
+#include <QHash>
+#include <QMap>
+#include <QRegularExpression>
+#include <QSharedPointer>
+#include <QString>
+#include <QVector>
+
+
+namespace Material
+{
+
+typedef QSharedPointer<const InternalSettings> InternalSettingsPtr;
+
+/**
+ * Window specific settings, read from the "Windeco Exception N" groups.
+ *
+ * Each group holds ExceptionType, ExceptionPattern, Enabled and any other
+ * entry of the Windeco group that it overrides. Patterns are compiled once
+ * when the list is loaded. Results for window classes are memoized, since
+ * a class never changes and many windows share one.
+ */
+class ExceptionList
+{
+public:
+    ExceptionList() = default;
+    explicit ExceptionList(const KSharedConfig::Ptr &config);
+
+    bool hasClassExceptions() const { return !m_classExceptions.isEmpty(); }
+    bool hasTitleExceptions() const { return !m_titleExceptions.isEmpty(); }
+
+    //* settings of the first exception that matches, or null
+    InternalSettingsPtr match(const QString &windowClass, const QString &caption) const;
+
+    //* whether both lists were loaded from the same entries
+    bool hasSameEntries(const ExceptionList &other) const;
+
+private:
+    struct Exception
+    {
+        QString pattern;
+        bool literal = false;
+        QRegularExpression regularExpression;
+        InternalSettingsPtr settings;
+
+        bool matches(const QString &value) const;
+    };
+
+    static QString groupName(int index);
+
+    int matchClass(const QString &windowClass) const;
+    int matchTitle(const QString &caption) const;
+
+    // In the order of the config, the first match wins.
+    QVector<Exception> m_exceptions;
+    QVector<int> m_classExceptions;
+    QVector<int> m_titleExceptions;
+
+    QVector<QMap<QString, QString>> m_entries;
+
+    //* window class -> index of the first matching class exception, or -1
+    mutable QHash<QString, int> m_classMatches;
+};
+
+} // namespace Material
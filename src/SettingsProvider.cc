@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2020 Chris Holland <zrenfire@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// own
+#include "SettingsProvider.h"
+#include "Material.h"
+
+// KF
+#include <KConfigSkeleton>
+
+
+namespace Material
+{
+
+SettingsProvider *SettingsProvider::s_self = nullptr;
+
+SettingsProvider::SettingsProvider()
+    : m_internalSettings(new InternalSettings())
+    , m_exceptions(m_internalSettings->sharedConfig())
+{
+}
+
+SettingsProvider::~SettingsProvider()
+{
+    s_self = nullptr;
+}
+
+SettingsProvider *SettingsProvider::self()
+{
+    if (!s_self) {
+        s_self = new SettingsProvider();
+    }
+    return s_self;
+}
+
+void SettingsProvider::release()
+{
+    delete s_self;
+}
+
+InternalSettingsPtr SettingsProvider::internalSettings() const
+{
+    return m_internalSettings;
+}
+
+InternalSettingsPtr SettingsProvider::internalSettings(const QString &windowClass, const QString &caption) const
+{
+    const InternalSettingsPtr exception = m_exceptions.match(windowClass, caption);
+    return exception ? exception : m_internalSettings;
+}
+
+const ExceptionList &SettingsProvider::exceptions() const
+{
+    return m_exceptions;
+}
+
+void SettingsProvider::watch(KDecoration2::DecorationSettings *settings)
+{
+    // KWin shares one DecorationSettings between all decorations, so the
+    // settings are reloaded once per change rather than once per window.
+    connect(settings, &KDecoration2::DecorationSettings::reconfigured,
+            this, &SettingsProvider::reconfigure,
+            Qt::UniqueConnection);
+}
+
+void SettingsProvider::reconfigure()
+{
+    // The skeleton reads the cached config as its items are added,
+    // load() is what picks up the changes on disk.
+    InternalSettings *internalSettings = new InternalSettings();
+    internalSettings->load();
+
+    QSet<QString> changedKeys;
+    const KConfigSkeletonItem::List items = internalSettings->items();
+    for (const KConfigSkeletonItem *item : items) {
+        const KConfigSkeletonItem *oldItem = m_internalSettings->findItem(item->name());
+        if (!oldItem || oldItem->property() != item->property()) {
+            changedKeys.insert(item->name());
+        }
+    }
+
+    ExceptionList exceptions(internalSettings->sharedConfig());
+    if (!exceptions.hasSameEntries(m_exceptions)) {
+        changedKeys.insert(QStringLiteral("Exceptions"));
+    }
+
+    m_internalSettings = InternalSettingsPtr(internalSettings);
+    m_exceptions = exceptions;
+
+    if (!changedKeys.isEmpty()) {
+        qCDebug(category) << "Settings changed:" << changedKeys;
+        emit settingsChanged(changedKeys);
+    }
+}
+
+} // namespace Material
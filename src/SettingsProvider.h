@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2020 Chris Holland <zrenfire@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// own
+#include "ExceptionList.h"
+#include "InternalSettings.h"
+
+// KDecoration
+#include <KDecoration2/DecorationSettings>
+
+// Qt
+#include <QObject>
+#include <QSet>
+#include <QSharedPointer>
+#include <QString>
+
+
+namespace Material
+{
+
+/**
+ * Loads kdecoration_materialrc once per process and hands the same
+ * settings to every decoration.
+ *
+ * A snapshot is never modified. When the settings are reloaded, a new
+ * snapshot replaces the old one and settingsChanged() carries the names of
+ * the entries that differ between the two. "Exceptions" stands for any
+ * change of the window specific exceptions.
+ */
+class SettingsProvider : public QObject
+{
+    Q_OBJECT
+
+public:
+    ~SettingsProvider() override;
+
+    static SettingsProvider *self();
+
+    //* deletes the instance, once no decoration is left
+    static void release();
+
+    InternalSettingsPtr internalSettings() const;
+
+    //* settings for a window, taking exceptions into account
+    InternalSettingsPtr internalSettings(const QString &windowClass, const QString &caption) const;
+
+    const ExceptionList &exceptions() const;
+
+    //* reload whenever these settings are reconfigured
+    void watch(KDecoration2::DecorationSettings *settings);
+
+public slots:
+    void reconfigure();
+
+signals:
+    void settingsChanged(const QSet<QString> &changedKeys);
+
+private:
+    SettingsProvider();
+
+    InternalSettingsPtr m_internalSettings;
+    ExceptionList m_exceptions;
+
+    static SettingsProvider *s_self;
+};
+
+} // namespace Material
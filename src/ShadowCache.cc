@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2020 Chris Holland <zrenfire@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// own
+#include "ShadowCache.h"
+#include "Material.h"
+
+// Qt
+#include <QWeakPointer>
+
+
+namespace Material
+{
+
+ShadowCache::ShadowCache(int capacity)
+    : m_capacity(capacity)
+{
+}
+
+QSharedPointer<KDecoration2::DecorationShadow> ShadowCache::shadow(const QByteArray &key)
+{
+    for (int i = 0; i < m_entries.size(); ++i) {
+        if (m_entries.at(i).first == key) {
+            ++m_hits;
+            m_entries.move(i, 0);
+            return m_entries.first().second;
+        }
+    }
+
+    ++m_misses;
+    qCDebug(category) << "Shadow cache miss, hits:" << m_hits << "misses:" << m_misses;
+    return QSharedPointer<KDecoration2::DecorationShadow>();
+}
+
+void ShadowCache::insert(const QByteArray &key, const QSharedPointer<KDecoration2::DecorationShadow> &shadow)
+{
+    for (int i = 0; i < m_entries.size(); ++i) {
+        if (m_entries.at(i).first == key) {
+            m_entries.remove(i);
+            break;
+        }
+    }
+
+    m_entries.prepend(Entry(key, shadow));
+    evict();
+}
+
+void ShadowCache::clear()
+{
+    m_entries.clear();
+}
+
+void ShadowCache::evict()
+{
+    // QSharedPointer does not expose its reference count. Drop our own
+    // reference and see whether the shadow is still alive, if it is, some
+    // decoration uses it and the reference is taken back.
+    for (int i = m_entries.size() - 1; i >= 0 && m_entries.size() > m_capacity; --i) {
+        QWeakPointer<KDecoration2::DecorationShadow> weak = m_entries.at(i).second;
+        m_entries[i].second.reset();
+
+        const QSharedPointer<KDecoration2::DecorationShadow> strong = weak.toStrongRef();
+        if (strong) {
+            m_entries[i].second = strong;
+        } else {
+            m_entries.remove(i);
+        }
+    }
+}
+
+} // namespace Material
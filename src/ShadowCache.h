@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2020 Chris Holland <zrenfire@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// KDecoration
+#include <KDecoration2/DecorationShadow>
+
+// Qt
+#include <QByteArray>
+#include <QPair>
+#include <QSharedPointer>
+#include <QVector>
+
+
+namespace Material
+{
+
+/**
+ * Small LRU map of shadows shared between all decorations.
+ *
+ * Shadows that are still set on a decoration are never evicted, the cache
+ * can temporarily grow past its capacity instead. Dropping them would not
+ * free any memory and the next decoration with the same settings would
+ * create a duplicate texture.
+ */
+class ShadowCache
+{
+public:
+    explicit ShadowCache(int capacity = 4);
+
+    QSharedPointer<KDecoration2::DecorationShadow> shadow(const QByteArray &key);
+    void insert(const QByteArray &key, const QSharedPointer<KDecoration2::DecorationShadow> &shadow);
+    void clear();
+
+    int hits() const { return m_hits; }
+    int misses() const { return m_misses; }
+
+private:
+    void evict();
+
+    typedef QPair<QByteArray, QSharedPointer<KDecoration2::DecorationShadow>> Entry;
+
+    // Most recently used first.
+    QVector<Entry> m_entries;
+    int m_capacity;
+    int m_hits = 0;
+    int m_misses = 0;
+};
+
+} // namespace Material
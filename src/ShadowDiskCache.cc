@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2020 Chris Holland <zrenfire@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// own
+#include "ShadowDiskCache.h"
+#include "Material.h"
+
+// Qt
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QScopedPointer>
+#include <QStandardPaths>
+
+// std
+#include <cstring>
+
+
+namespace Material
+{
+
+namespace
+{
+
+const quint32 SHADOW_CACHE_MAGIC = 0x4d534844; // "MSHD"
+
+// Bump it whenever either the file layout or the way shadows are
+// rendered changes, stale entries are then thrown away on load.
+const quint32 SHADOW_CACHE_VERSION = 2;
+
+// Far beyond the largest shadow, 4 * 64 + 1 pixels at a scale of 4. It
+// keeps a corrupt header from describing an image larger than the file.
+const qint32 SHADOW_CACHE_MAX_SIZE = 4096;
+
+// Pixels start at a fixed offset so that scanlines stay aligned.
+const qint64 SHADOW_CACHE_HEADER_SIZE = 64;
+
+struct ShadowCacheHeader
+{
+    quint32 magic;
+    quint32 version;
+    qint32 width;
+    qint32 height;
+    qint32 bytesPerLine;
+    qint32 paddingLeft;
+    qint32 paddingTop;
+    qint32 paddingRight;
+    qint32 paddingBottom;
+    double devicePixelRatio;
+};
+
+static_assert(sizeof(ShadowCacheHeader) <= SHADOW_CACHE_HEADER_SIZE,
+              "Shadow cache header does not fit into the reserved space");
+
+bool isValidHeader(const ShadowCacheHeader &header, qint64 fileSize)
+{
+    if (header.magic != SHADOW_CACHE_MAGIC || header.version != SHADOW_CACHE_VERSION) {
+        return false;
+    }
+    if (header.width <= 0 || header.height <= 0
+        || header.width > SHADOW_CACHE_MAX_SIZE || header.height > SHADOW_CACHE_MAX_SIZE) {
+        return false;
+    }
+    if (qint64(header.bytesPerLine) < qint64(header.width) * 4 || header.bytesPerLine % 4 != 0) {
+        return false;
+    }
+    if (!(header.devicePixelRatio > 0)) {
+        return false;
+    }
+    return fileSize == SHADOW_CACHE_HEADER_SIZE + qint64(header.bytesPerLine) * header.height;
+}
+
+// The mapping lives as long as the file is open.
+void closeMappedFile(void *info)
+{
+    delete static_cast<QFile *>(info);
+}
+
+} // anonymous namespace
+
+ShadowDiskCache::ShadowDiskCache(qint64 maxSize)
+    : m_maxSize(maxSize)
+{
+}
+
+ShadowDiskCache::Entry ShadowDiskCache::load(const QByteArray &key)
+{
+    QScopedPointer<QFile> file(new QFile(filePath(key)));
+    if (!file->open(QIODevice::ReadOnly)) {
+        return Entry();
+    }
+
+    const qint64 fileSize = file->size();
+    // A private mapping is writable, so that the image can take it without
+    // a copy. Nothing writes to shadow textures though, so the pages stay
+    // shared with the page cache.
+    uchar *data = fileSize >= SHADOW_CACHE_HEADER_SIZE
+        ? file->map(0, fileSize, QFileDevice::MapPrivateOption)
+        : nullptr;
+
+    ShadowCacheHeader header;
+    if (data) {
+        std::memcpy(&header, data, sizeof(header));
+    }
+
+    if (!data || !isValidHeader(header, fileSize)) {
+        qCDebug(category) << "Discarding invalid shadow cache entry" << file->fileName();
+        file->remove();
+        return Entry();
+    }
+
+    // Eviction drops the least recently used entries first.
+#if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
+    file->setFileTime(QDateTime::currentDateTimeUtc(), QFileDevice::FileModificationTime);
+#endif
+
+    Entry entry;
+    entry.padding = QMargins(
+        header.paddingLeft,
+        header.paddingTop,
+        header.paddingRight,
+        header.paddingBottom);
+    entry.image = QImage(
+        data + SHADOW_CACHE_HEADER_SIZE,
+        header.width,
+        header.height,
+        header.bytesPerLine,
+        QImage::Format_ARGB32_Premultiplied,
+        closeMappedFile,
+        file.take());
+    entry.image.setDevicePixelRatio(header.devicePixelRatio);
+
+    return entry;
+}
+
+void ShadowDiskCache::store(const QByteArray &key, const QImage &image, const QMargins &padding)
+{
+    if (image.isNull() || !QDir().mkpath(cacheDir())) {
+        return;
+    }
+
+    const QImage pixels = image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+
+    ShadowCacheHeader header;
+    header.magic = SHADOW_CACHE_MAGIC;
+    header.version = SHADOW_CACHE_VERSION;
+    header.width = pixels.width();
+    header.height = pixels.height();
+    header.bytesPerLine = pixels.bytesPerLine();
+    header.paddingLeft = padding.left();
+    header.paddingTop = padding.top();
+    header.paddingRight = padding.right();
+    header.paddingBottom = padding.bottom();
+    header.devicePixelRatio = pixels.devicePixelRatio();
+
+    QByteArray headerData(SHADOW_CACHE_HEADER_SIZE, 0);
+    std::memcpy(headerData.data(), &header, sizeof(header));
+
+    // QSaveFile replaces the entry with a rename, so images that still
+    // map the old file are not affected.
+    QSaveFile file(filePath(key));
+    if (!file.open(QIODevice::WriteOnly)) {
+        return;
+    }
+
+    const qint64 pixelsSize = qint64(pixels.bytesPerLine()) * pixels.height();
+    if (file.write(headerData) != headerData.size()
+        || file.write(reinterpret_cast<const char *>(pixels.constBits()), pixelsSize) != pixelsSize) {
+        file.cancelWriting();
+        return;
+    }
+
+    if (file.commit()) {
+        evict();
+    }
+}
+
+QString ShadowDiskCache::cacheDir() const
+{
+    // Shadows are rendered on worker threads, so the path is resolved
+    // through a thread-safe static rather than a lazily set member.
+    static const QString dir = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation)
+        + QStringLiteral("/kdecoration_material");
+    return dir;
+}
+
+QString ShadowDiskCache::filePath(const QByteArray &key) const
+{
+    return cacheDir() + QLatin1Char('/') + QString::fromLatin1(key.toHex()) + QStringLiteral(".shadow");
+}
+
+void ShadowDiskCache::evict()
+{
+    const QDir dir(cacheDir());
+    const QFileInfoList entries = dir.entryInfoList(
+        { QStringLiteral("*.shadow") },
+        QDir::Files,
+        QDir::Time); // Newest first
+
+    qint64 totalSize = 0;
+    for (const QFileInfo &info : entries) {
+        totalSize += info.size();
+        if (totalSize > m_maxSize) {
+            QFile::remove(info.absoluteFilePath());
+        }
+    }
+}
+
+} // namespace Material
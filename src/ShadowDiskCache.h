@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2020 Chris Holland <zrenfire@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// Qt
+#include <QByteArray>
+#include <QImage>
+#include <QMargins>
+#include <QString>
+
+
+namespace Material
+{
+
+/**
+ * Keeps rendered shadow textures in $XDG_CACHE_HOME/kdecoration_material so
+ * they survive KWin restarts and can be shared with the KCM preview.
+ *
+ * Every entry is a small header, which holds the padding and the device
+ * pixel ratio, followed by raw premultiplied ARGB32 pixels. Loaded images
+ * point straight into the memory mapped file.
+ *
+ * load() and store() may be called from worker threads.
+ */
+class ShadowDiskCache
+{
+public:
+    struct Entry
+    {
+        QImage image;
+        QMargins padding;
+
+        bool isNull() const { return image.isNull(); }
+    };
+
+    explicit ShadowDiskCache(qint64 maxSize = 8 * 1024 * 1024);
+
+    Entry load(const QByteArray &key);
+    void store(const QByteArray &key, const QImage &image, const QMargins &padding);
+
+private:
+    QString cacheDir() const;
+    QString filePath(const QByteArray &key) const;
+    void evict();
+
+    qint64 m_maxSize;
+};
+
+} // namespace Material
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2020 Chris Holland <zrenfire@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// own
+#include "X11Atoms.h"
+#include "Material.h"
+
+// Qt
+#include <QScopedPointer>
+#include <QX11Info>
+
+// std
+#include <cstring>
+
+
+namespace Material
+{
+
+namespace
+{
+
+// In the order of X11Atoms::Atom.
+const char *const s_atomNames[X11Atoms::AtomCount] = {
+    "_KDE_NET_WM_APPMENU_SERVICE_NAME",
+    "_KDE_NET_WM_APPMENU_OBJECT_PATH",
+    "_NET_WM_MOVERESIZE",
+};
+
+enum State
+{
+    Unrequested,
+    Requested,
+    Resolved
+};
+
+State s_state = Unrequested;
+xcb_intern_atom_cookie_t s_cookies[X11Atoms::AtomCount];
+xcb_atom_t s_atoms[X11Atoms::AtomCount];
+
+} // anonymous namespace
+
+void X11Atoms::prefetch()
+{
+    if (s_state != Unrequested || !QX11Info::isPlatformX11()) {
+        return;
+    }
+
+    auto *c = QX11Info::connection();
+    for (int i = 0; i < AtomCount; ++i) {
+        const char *name = s_atomNames[i];
+        s_cookies[i] = xcb_intern_atom(c, false, std::strlen(name), name);
+    }
+    xcb_flush(c);
+
+    s_state = Requested;
+}
+
+void X11Atoms::resolve()
+{
+    auto *c = QX11Info::connection();
+    for (int i = 0; i < AtomCount; ++i) {
+        QScopedPointer<xcb_intern_atom_reply_t, QScopedPointerPodDeleter> reply(xcb_intern_atom_reply(c, s_cookies[i], nullptr));
+        s_atoms[i] = reply ? reply->atom : XCB_ATOM_NONE;
+
+        if (s_atoms[i] == XCB_ATOM_NONE) {
+            qCDebug(category) << "Could not intern" << s_atomNames[i];
+        }
+    }
+
+    s_state = Resolved;
+}
+
+xcb_atom_t X11Atoms::atom(Atom atom)
+{
+    if (s_state == Unrequested) {
+        prefetch();
+        if (s_state == Unrequested) {
+            return XCB_ATOM_NONE;
+        }
+    }
+
+    if (s_state == Requested) {
+        resolve();
+    }
+
+    return s_atoms[atom];
+}
+
+} // namespace Material
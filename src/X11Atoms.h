@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2020 Chris Holland <zrenfire@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// X11
+#include <xcb/xcb.h>
+
+
+namespace Material
+{
+
+/**
+ * Every X11 atom the plugin uses, interned once per process.
+ *
+ * prefetch() sends the intern requests for all of them in one burst,
+ * and the replies are only read when an atom is first needed. By then
+ * they have usually arrived, so nobody waits for the X server.
+ */
+class X11Atoms
+{
+public:
+    enum Atom
+    {
+        AppMenuServiceName,
+        AppMenuObjectPath,
+        NetWmMoveResize,
+        AtomCount
+    };
+
+    //* send the intern requests, without waiting for the replies
+    static void prefetch();
+
+    //* XCB_ATOM_NONE if the atom couldn't be interned
+    static xcb_atom_t atom(Atom atom);
+
+private:
+    //* read the replies of the requests sent by prefetch()
+    static void resolve();
+};
+
+} // namespace Material
@@ -0,0 +1,296 @@
+/*
+ * Copyright (C) 2020 Chris Holland <zrenfire@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Fetches the menu layout of a large application over a peer to peer
+ * connection and prints the time spent in the DBusMenuLayoutItem
+ * demarshaller. The layout is a 2000 item menu bar, the size a large
+ * application exports, served by an exporter inside the benchmark.
+ *
+ * Then it imports that menu and feeds the importer batches of property
+ * updates, as media players send them for their playback menus, and
+ * prints the time spent applying them to the actions.
+ *
+ *   dbusmenu_bench [--iterations N]
+ */
+
+// libdbusmenuqt
+#include "dbusmenuimporter.h"
+#include "dbusmenutypes_p.h"
+
+// Qt
+#include <QAction>
+#include <QApplication>
+#include <QCommandLineParser>
+#include <QDBusConnection>
+#include <QDBusMessage>
+#include <QDBusPendingCallWatcher>
+#include <QDBusPendingReply>
+#include <QDBusServer>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QTextStream>
+#include <QThread>
+
+// std
+#include <cstdlib>
+
+
+namespace
+{
+
+const int s_menuCount = 10;
+const int s_itemsPerMenu = 199;
+const int s_lastItemId = s_menuCount * (s_itemsPerMenu + 1);
+
+const QString s_objectPath = QStringLiteral("/MenuBar");
+
+class LayoutExporter : public QObject
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "com.canonical.dbusmenu")
+
+public:
+    explicit LayoutExporter(const DBusMenuLayoutItem &layout)
+        : QObject()
+        , m_layout(layout)
+    {}
+
+public Q_SLOTS:
+    uint GetLayout(int parentId, int recursionDepth, const QStringList &propertyNames, DBusMenuLayoutItem &item)
+    {
+        Q_UNUSED(parentId)
+        Q_UNUSED(recursionDepth)
+        Q_UNUSED(propertyNames)
+        item = m_layout;
+        return 1;
+    }
+
+private:
+    DBusMenuLayoutItem m_layout;
+};
+
+DBusMenuLayoutItem createItem(int id, const QString &label)
+{
+    DBusMenuLayoutItem item;
+    item.id = id;
+    item.properties.insert(QStringLiteral("label"), label);
+    item.properties.insert(QStringLiteral("enabled"), true);
+    item.properties.insert(QStringLiteral("visible"), true);
+    return item;
+}
+
+DBusMenuLayoutItem createLayout()
+{
+    DBusMenuLayoutItem root;
+    root.id = 0;
+    root.properties.insert(QStringLiteral("children-display"), QStringLiteral("submenu"));
+
+    int id = 1;
+    for (int menu = 0; menu < s_menuCount; ++menu) {
+        DBusMenuLayoutItem menuItem = createItem(id++, QStringLiteral("Menu &%1").arg(menu));
+        menuItem.properties.insert(QStringLiteral("children-display"), QStringLiteral("submenu"));
+
+        for (int i = 0; i < s_itemsPerMenu; ++i) {
+            DBusMenuLayoutItem item = createItem(id++, QStringLiteral("Action %1").arg(i));
+            if (i % 3 == 0) {
+                item.properties.insert(QStringLiteral("icon-name"), QStringLiteral("document-open"));
+            }
+            if (i % 5 == 0) {
+                item.properties.insert(QStringLiteral("toggle-type"), QStringLiteral("checkmark"));
+                item.properties.insert(QStringLiteral("toggle-state"), 1);
+            }
+            menuItem.children.append(item);
+        }
+        root.children.append(menuItem);
+    }
+    return root;
+}
+
+// Changes the label, enabled and checked state of batchSize items spread
+// over the whole menu, to values which depend on generation.
+DBusMenuItemList createPropertiesBatch(int batchSize, int generation)
+{
+    DBusMenuItemList batch;
+    batch.reserve(batchSize);
+    for (int i = 0; i < batchSize; ++i) {
+        DBusMenuItem item;
+        item.id = 1 + (i * s_lastItemId / batchSize);
+        item.properties.insert(QStringLiteral("label"), QStringLiteral("Track %1 - %2").arg(i).arg(generation));
+        item.properties.insert(QStringLiteral("enabled"), generation % 2 == 0);
+        item.properties.insert(QStringLiteral("toggle-state"), generation % 2);
+        item.properties.insert(QStringLiteral("visible"), true);
+        batch.append(item);
+    }
+    return batch;
+}
+
+// The reply stays undecoded until argumentAt() is called, so only the
+// demarshaller is timed, not the round trip.
+int runLayoutBench(const QDBusConnection &client, int iterations)
+{
+    QDBusMessage call = QDBusMessage::createMethodCall(QString(), s_objectPath,
+        QStringLiteral("com.canonical.dbusmenu"), QStringLiteral("GetLayout"));
+    call << 0 << -1 << QStringList();
+
+    qint64 elapsed = 0;
+    int itemCount = 0;
+    for (int i = 0; i < iterations; ++i) {
+        QDBusPendingCallWatcher watcher(client.asyncCall(call));
+        QEventLoop loop;
+        QObject::connect(&watcher, &QDBusPendingCallWatcher::finished, &loop, &QEventLoop::quit);
+        if (!watcher.isFinished()) {
+            loop.exec();
+        }
+
+        QDBusPendingReply<uint, DBusMenuLayoutItem> reply = watcher;
+        if (reply.isError()) {
+            qCritical() << "GetLayout failed" << reply.error().message();
+            return EXIT_FAILURE;
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+        const DBusMenuLayoutItem layout = reply.argumentAt<1>();
+        elapsed += timer.nsecsElapsed();
+        itemCount = layoutItemCount(layout);
+    }
+
+    const qint64 nsPerLayout = elapsed / iterations;
+
+    QTextStream out(stdout);
+    out << "items\tns/layout\tns/item\n";
+    out << itemCount << '\t'
+        << nsPerLayout << '\t'
+        << nsPerLayout / qMax(1, itemCount) << '\n';
+    out.flush();
+
+    return EXIT_SUCCESS;
+}
+
+int runPropertiesBench(const QDBusConnection &client, int iterations)
+{
+    DBusMenuImporter importer(QString(), s_objectPath, client, -1);
+    importer.menu();
+
+    QElapsedTimer importTimer;
+    importTimer.start();
+    while (!importer.actionForId(s_lastItemId)) {
+        if (importTimer.hasExpired(5000)) {
+            qCritical() << "The importer did not build the menu";
+            return EXIT_FAILURE;
+        }
+        QCoreApplication::processEvents();
+        QThread::msleep(1);
+    }
+
+    QTextStream out(stdout);
+    out << "batch\tns/batch\tns/item\n";
+
+    const DBusMenuItemKeysList removedList;
+    for (const int batchSize : { 10, 100, 1000, s_lastItemId }) {
+        const DBusMenuItemList batches[2] = {
+            createPropertiesBatch(batchSize, 0),
+            createPropertiesBatch(batchSize, 1),
+        };
+
+        QElapsedTimer timer;
+        timer.start();
+        for (int i = 0; i < iterations; ++i) {
+            const bool invoked = QMetaObject::invokeMethod(&importer, "slotItemsPropertiesUpdated", Qt::DirectConnection,
+                Q_ARG(DBusMenuItemList, batches[i % 2]),
+                Q_ARG(DBusMenuItemKeysList, removedList));
+            if (!invoked) {
+                qCritical() << "Could not invoke slotItemsPropertiesUpdated";
+                return EXIT_FAILURE;
+            }
+        }
+        const qint64 nsPerBatch = timer.nsecsElapsed() / iterations;
+
+        out << batchSize << '\t'
+            << nsPerBatch << '\t'
+            << nsPerBatch / batchSize << '\n';
+        out.flush();
+    }
+
+    return EXIT_SUCCESS;
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv)
+{
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+
+    QApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption iterationsOption(QStringLiteral("iterations"),
+        QStringLiteral("Number of decoded layouts and of batches per batch size."),
+        QStringLiteral("count"), QStringLiteral("200"));
+    parser.addOption(iterationsOption);
+    parser.process(app);
+
+    const int iterations = qMax(1, parser.value(iterationsOption).toInt());
+
+    DBusMenuTypes_register();
+
+    LayoutExporter exporter(createLayout());
+
+    QDBusServer server;
+    if (!server.isConnected()) {
+        qCritical() << "Could not start the peer to peer server" << server.lastError().message();
+        return EXIT_FAILURE;
+    }
+
+    bool registered = false;
+    QList<QDBusConnection> serverConnections;
+    QObject::connect(&server, &QDBusServer::newConnection, &server, [&exporter, &serverConnections, &registered](const QDBusConnection &connection) {
+        QDBusConnection serverConnection(connection);
+        serverConnection.registerObject(s_objectPath, &exporter, QDBusConnection::ExportAllSlots);
+        serverConnections.append(serverConnection);
+        registered = true;
+    });
+
+    // Calls made before the exporter is registered would fail.
+    const QDBusConnection client = QDBusConnection::connectToPeer(server.address(), QStringLiteral("dbusmenu_bench"));
+    QElapsedTimer connectTimer;
+    connectTimer.start();
+    while (!registered) {
+        if (!client.isConnected() || connectTimer.hasExpired(5000)) {
+            qCritical() << "Could not connect to the peer to peer server" << client.lastError().message();
+            return EXIT_FAILURE;
+        }
+        QCoreApplication::processEvents();
+        QThread::msleep(1);
+    }
+
+    const int result = runLayoutBench(client, iterations);
+    if (result != EXIT_SUCCESS) {
+        return result;
+    }
+
+    QTextStream(stdout) << '\n';
+    return runPropertiesBench(client, iterations);
+}
+
+#include "DBusMenuBench.moc"
@@ -0,0 +1,279 @@
+/*
+ * Copyright (C) 2020 Chris Holland <zrenfire@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Renders Decoration::paint into a QImage for a matrix of window states
+ * and prints, per frame, the time spent, the number of heap allocations
+ * and the number of QPainter::save() calls made by the plugin.
+ *
+ * It runs on the offscreen platform unless QT_QPA_PLATFORM says otherwise.
+ *
+ *   materialdecoration_bench [--iterations N] [--plugin PATH]
+ */
+
+// own
+#include "MockBridge.h"
+
+// KDecoration
+#include <KDecoration2/Decoration>
+#include <KDecoration2/DecorationSettings>
+
+// KF
+#include <KConfigGroup>
+#include <KPluginFactory>
+#include <KPluginLoader>
+#include <KSharedConfig>
+
+// Qt
+#include <QApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QImage>
+#include <QPainter>
+#include <QStandardPaths>
+#include <QTextStream>
+#include <QThreadPool>
+
+// std
+#include <atomic>
+#include <cstdlib>
+
+// glibc
+#include <dlfcn.h>
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+namespace
+{
+std::atomic<quint64> s_allocations(0);
+std::atomic<quint64> s_painterSaves(0);
+
+// Set only around the measured paint calls. Shadow jobs run on the thread
+// pool meanwhile, and their work must not be charged to the frames.
+thread_local bool s_counting = false;
+} // anonymous namespace
+
+// The executable exports these, so they take precedence over the ones in
+// libc and QtGui for everything the plugin calls.
+extern "C" void *malloc(size_t size)
+{
+    if (s_counting) {
+        s_allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+    if (s_counting) {
+        s_allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    if (s_counting) {
+        s_allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    return __libc_realloc(ptr, size);
+}
+
+void QPainter::save()
+{
+    typedef void (*SaveFunction)(QPainter *);
+    static const SaveFunction realSave = reinterpret_cast<SaveFunction>(
+        dlsym(RTLD_NEXT, "_ZN8QPainter4saveEv"));
+
+    if (s_counting) {
+        s_painterSaves.fetch_add(1, std::memory_order_relaxed);
+    }
+    realSave(this);
+}
+
+namespace Material
+{
+namespace
+{
+
+struct BenchCase
+{
+    int width;
+    QString buttonType;
+    bool gradient;
+    bool alphaChannelSupported;
+    bool active;
+    QString caption;
+};
+
+struct BenchResult
+{
+    qint64 nsPerFrame;
+    qreal allocationsPerFrame;
+    qreal savesPerFrame;
+};
+
+void writeDecorationConfig(const QString &buttonType, bool gradient)
+{
+    KSharedConfig::Ptr config = KSharedConfig::openConfig(QStringLiteral("kdecoration_materialrc"));
+    KConfigGroup group = config->group(QStringLiteral("Windeco"));
+    group.writeEntry("ButtonType", buttonType);
+    group.writeEntry("DrawBackgroundGradient", gradient);
+    config->sync();
+}
+
+BenchResult runCase(KPluginFactory *factory, MockBridge &bridge, const BenchCase &benchCase, int iterations)
+{
+    writeDecorationConfig(benchCase.buttonType, benchCase.gradient);
+
+    bridge.clientState.width = benchCase.width;
+    bridge.clientState.active = benchCase.active;
+    bridge.clientState.caption = benchCase.caption;
+    bridge.alphaChannelSupported = benchCase.alphaChannelSupported;
+
+    const QVariantMap args({ { QStringLiteral("bridge"), QVariant::fromValue(static_cast<KDecoration2::DecorationBridge *>(&bridge)) } });
+    KDecoration2::Decoration *decoration = factory->create<KDecoration2::Decoration>(nullptr, QVariantList({ args }));
+    decoration->setSettings(QSharedPointer<KDecoration2::DecorationSettings>::create(&bridge));
+    decoration->init();
+
+    QImage image(decoration->size(), QImage::Format_ARGB32_Premultiplied);
+    image.fill(Qt::transparent);
+    QPainter painter(&image);
+
+    // Clearing the caches between cases makes init() render the shadow
+    // again. Let it finish, so it doesn't compete with the frames.
+    QThreadPool::globalInstance()->waitForDone();
+
+    // Warm up caches so that only steady state frames are measured.
+    for (int i = 0; i < qMax(1, iterations / 10); ++i) {
+        decoration->paint(&painter, decoration->rect());
+    }
+
+    const quint64 allocationsBefore = s_allocations.load();
+    const quint64 savesBefore = s_painterSaves.load();
+
+    QElapsedTimer timer;
+    timer.start();
+    s_counting = true;
+    for (int i = 0; i < iterations; ++i) {
+        decoration->paint(&painter, decoration->rect());
+    }
+    s_counting = false;
+    const qint64 elapsed = timer.nsecsElapsed();
+
+    BenchResult result;
+    result.nsPerFrame = elapsed / iterations;
+    result.allocationsPerFrame = static_cast<qreal>(s_allocations.load() - allocationsBefore) / iterations;
+    result.savesPerFrame = static_cast<qreal>(s_painterSaves.load() - savesBefore) / iterations;
+
+    painter.end();
+    delete decoration;
+
+    return result;
+}
+
+QVector<BenchCase> benchCases()
+{
+    const QVector<int> widths = { 400, 800, 1600, 3200 };
+    const QStringList buttonTypes = {
+        QStringLiteral("ButtonMaterial"),
+        QStringLiteral("ButtonMacOS"),
+        QStringLiteral("ButtonBreeze"),
+    };
+    const QStringList captions = {
+        QStringLiteral("Konsole"),
+        QStringLiteral("material-decoration : Decoration.cc — Kate"),
+        QStringLiteral("A very long caption that does not fit into the title bar of a narrow window and has to be elided — ").repeated(3),
+    };
+
+    QVector<BenchCase> cases;
+    for (const QString &buttonType : buttonTypes) {
+        for (const bool gradient : { true, false }) {
+            for (const int width : widths) {
+                for (const bool alphaChannelSupported : { true, false }) {
+                    for (const bool active : { true, false }) {
+                        for (const QString &caption : captions) {
+                            cases.append({ width, buttonType, gradient, alphaChannelSupported, active, caption });
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return cases;
+}
+
+} // anonymous namespace
+} // namespace Material
+
+int main(int argc, char **argv)
+{
+    using namespace Material;
+
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+
+    // Keep the config and the shadow cache of the user out of it.
+    QStandardPaths::setTestModeEnabled(true);
+
+    QApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption iterationsOption(QStringLiteral("iterations"),
+        QStringLiteral("Number of measured frames per case."),
+        QStringLiteral("count"), QStringLiteral("200"));
+    QCommandLineOption pluginOption(QStringLiteral("plugin"),
+        QStringLiteral("Path of the decoration plugin."),
+        QStringLiteral("path"), QStringLiteral(MATERIALDECORATION_PLUGIN_PATH));
+    parser.addOption(iterationsOption);
+    parser.addOption(pluginOption);
+    parser.process(app);
+
+    const int iterations = qMax(1, parser.value(iterationsOption).toInt());
+
+    KPluginLoader loader(parser.value(pluginOption));
+    KPluginFactory *factory = loader.factory();
+    if (!factory) {
+        qCritical() << "Could not load" << loader.fileName() << loader.errorString();
+        return EXIT_FAILURE;
+    }
+
+    MockBridge bridge;
+    QTextStream out(stdout);
+    out << "width\tbuttons\tgradient\talpha\tactive\tcaption\tns/frame\tallocs/frame\tsaves/frame\n";
+
+    for (const BenchCase &benchCase : benchCases()) {
+        const BenchResult result = runCase(factory, bridge, benchCase, iterations);
+        out << benchCase.width << '\t'
+            << benchCase.buttonType << '\t'
+            << benchCase.gradient << '\t'
+            << benchCase.alphaChannelSupported << '\t'
+            << benchCase.active << '\t'
+            << benchCase.caption.size() << '\t'
+            << result.nsPerFrame << '\t'
+            << result.allocationsPerFrame << '\t'
+            << result.savesPerFrame << '\n';
+        out.flush();
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,287 @@
+/*
+ * Copyright (C) 2020 Chris Holland <zrenfire@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// own
+#include "MockBridge.h"
+
+// Qt
+#include <QIcon>
+#include <QPalette>
+
+
+namespace Material
+{
+
+MockClient::MockClient(KDecoration2::DecoratedClient *client,
+                       KDecoration2::Decoration *decoration,
+                       const MockClientState &state)
+    : KDecoration2::DecoratedClientPrivate(client, decoration)
+    , m_state(state)
+{
+}
+
+bool MockClient::isActive() const
+{
+    return m_state.active;
+}
+
+QString MockClient::caption() const
+{
+    return m_state.caption;
+}
+
+int MockClient::desktop() const
+{
+    return 1;
+}
+
+bool MockClient::isOnAllDesktops() const
+{
+    return false;
+}
+
+bool MockClient::isShaded() const
+{
+    return false;
+}
+
+QIcon MockClient::icon() const
+{
+    return QIcon();
+}
+
+bool MockClient::isMaximized() const
+{
+    return false;
+}
+
+bool MockClient::isMaximizedHorizontally() const
+{
+    return false;
+}
+
+bool MockClient::isMaximizedVertically() const
+{
+    return false;
+}
+
+bool MockClient::isKeepAbove() const
+{
+    return false;
+}
+
+bool MockClient::isKeepBelow() const
+{
+    return false;
+}
+
+bool MockClient::isCloseable() const
+{
+    return true;
+}
+
+bool MockClient::isMaximizeable() const
+{
+    return true;
+}
+
+bool MockClient::isMinimizeable() const
+{
+    return true;
+}
+
+bool MockClient::providesContextHelp() const
+{
+    return false;
+}
+
+bool MockClient::isModal() const
+{
+    return false;
+}
+
+bool MockClient::isShadeable() const
+{
+    return true;
+}
+
+bool MockClient::isMoveable() const
+{
+    return true;
+}
+
+bool MockClient::isResizeable() const
+{
+    return true;
+}
+
+WId MockClient::windowId() const
+{
+    return 0;
+}
+
+WId MockClient::decorationId() const
+{
+    return 0;
+}
+
+int MockClient::width() const
+{
+    return m_state.width;
+}
+
+int MockClient::height() const
+{
+    return m_state.height;
+}
+
+QSize MockClient::size() const
+{
+    return QSize(m_state.width, m_state.height);
+}
+
+QPalette MockClient::palette() const
+{
+    return QPalette();
+}
+
+QColor MockClient::color(KDecoration2::ColorGroup group, KDecoration2::ColorRole role) const
+{
+    // Breeze colors
+    const bool active = group == KDecoration2::ColorGroup::Active;
+    switch (role) {
+    case KDecoration2::ColorRole::Frame:
+    case KDecoration2::ColorRole::TitleBar:
+        return active ? QColor(71, 80, 87) : QColor(239, 240, 241);
+    case KDecoration2::ColorRole::Foreground:
+        return active ? QColor(252, 252, 252) : QColor(189, 195, 199);
+    default:
+        return QColor();
+    }
+}
+
+Qt::Edges MockClient::adjacentScreenEdges() const
+{
+    return Qt::Edges();
+}
+
+void MockClient::requestShowToolTip(const QString &text)
+{
+    Q_UNUSED(text)
+}
+
+void MockClient::requestHideToolTip()
+{
+}
+
+void MockClient::requestClose()
+{
+}
+
+void MockClient::requestToggleMaximization(Qt::MouseButtons buttons)
+{
+    Q_UNUSED(buttons)
+}
+
+void MockClient::requestMinimize()
+{
+}
+
+void MockClient::requestContextHelp()
+{
+}
+
+void MockClient::requestToggleOnAllDesktops()
+{
+}
+
+void MockClient::requestToggleShade()
+{
+}
+
+void MockClient::requestToggleKeepAbove()
+{
+}
+
+void MockClient::requestToggleKeepBelow()
+{
+}
+
+void MockClient::requestShowWindowMenu()
+{
+}
+
+MockSettings::MockSettings(KDecoration2::DecorationSettings *parent, bool alphaChannelSupported)
+    : KDecoration2::DecorationSettingsPrivate(parent)
+    , m_alphaChannelSupported(alphaChannelSupported)
+{
+}
+
+bool MockSettings::isOnAllDesktopsAvailable() const
+{
+    return true;
+}
+
+bool MockSettings::isAlphaChannelSupported() const
+{
+    return m_alphaChannelSupported;
+}
+
+bool MockSettings::isCloseOnDoubleClickOnMenu() const
+{
+    return false;
+}
+
+QVector<KDecoration2::DecorationButtonType> MockSettings::decorationButtonsLeft() const
+{
+    return {
+        KDecoration2::DecorationButtonType::Menu,
+        KDecoration2::DecorationButtonType::OnAllDesktops,
+    };
+}
+
+QVector<KDecoration2::DecorationButtonType> MockSettings::decorationButtonsRight() const
+{
+    return {
+        KDecoration2::DecorationButtonType::ContextHelp,
+        KDecoration2::DecorationButtonType::Minimize,
+        KDecoration2::DecorationButtonType::Maximize,
+        KDecoration2::DecorationButtonType::Close,
+    };
+}
+
+KDecoration2::BorderSize MockSettings::borderSize() const
+{
+    return KDecoration2::BorderSize::Normal;
+}
+
+std::unique_ptr<KDecoration2::DecoratedClientPrivate> MockBridge::createClient(
+    KDecoration2::DecoratedClient *client,
+    KDecoration2::Decoration *decoration)
+{
+    return std::unique_ptr<KDecoration2::DecoratedClientPrivate>(
+        new MockClient(client, decoration, clientState));
+}
+
+std::unique_ptr<KDecoration2::DecorationSettingsPrivate> MockBridge::settings(
+    KDecoration2::DecorationSettings *parent)
+{
+    return std::unique_ptr<KDecoration2::DecorationSettingsPrivate>(
+        new MockSettings(parent, alphaChannelSupported));
+}
+
+} // namespace Material
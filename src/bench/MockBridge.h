@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2020 Chris Holland <zrenfire@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// KDecoration
+#include <KDecoration2/Private/DecoratedClientPrivate>
+#include <KDecoration2/Private/DecorationBridge>
+#include <KDecoration2/Private/DecorationSettingsPrivate>
+
+// Qt
+#include <QString>
+
+// std
+#include <memory>
+
+
+namespace Material
+{
+
+//* state of the fake window that gets decorated
+struct MockClientState
+{
+    QString caption;
+    int width = 800;
+    int height = 600;
+    bool active = true;
+};
+
+/**
+ * Window decorated by the benchmarks, it never talks to a window manager.
+ * It has no application menu, so AppMenuButtonGroup stays empty.
+ */
+class MockClient : public KDecoration2::DecoratedClientPrivate
+{
+public:
+    MockClient(KDecoration2::DecoratedClient *client,
+               KDecoration2::Decoration *decoration,
+               const MockClientState &state);
+
+    bool isActive() const override;
+    QString caption() const override;
+    int desktop() const override;
+    bool isOnAllDesktops() const override;
+    bool isShaded() const override;
+    QIcon icon() const override;
+    bool isMaximized() const override;
+    bool isMaximizedHorizontally() const override;
+    bool isMaximizedVertically() const override;
+    bool isKeepAbove() const override;
+    bool isKeepBelow() const override;
+
+    bool isCloseable() const override;
+    bool isMaximizeable() const override;
+    bool isMinimizeable() const override;
+    bool providesContextHelp() const override;
+    bool isModal() const override;
+    bool isShadeable() const override;
+    bool isMoveable() const override;
+    bool isResizeable() const override;
+
+    WId windowId() const override;
+    WId decorationId() const override;
+
+    int width() const override;
+    int height() const override;
+    QSize size() const override;
+    QPalette palette() const override;
+    QColor color(KDecoration2::ColorGroup group, KDecoration2::ColorRole role) const override;
+    Qt::Edges adjacentScreenEdges() const override;
+
+    void requestShowToolTip(const QString &text) override;
+    void requestHideToolTip() override;
+    void requestClose() override;
+    void requestToggleMaximization(Qt::MouseButtons buttons) override;
+    void requestMinimize() override;
+    void requestContextHelp() override;
+    void requestToggleOnAllDesktops() override;
+    void requestToggleShade() override;
+    void requestToggleKeepAbove() override;
+    void requestToggleKeepBelow() override;
+    void requestShowWindowMenu() override;
+
+private:
+    MockClientState m_state;
+};
+
+//* decoration settings as KWin would provide them, with fixed values
+class MockSettings : public KDecoration2::DecorationSettingsPrivate
+{
+public:
+    MockSettings(KDecoration2::DecorationSettings *parent, bool alphaChannelSupported);
+
+    bool isOnAllDesktopsAvailable() const override;
+    bool isAlphaChannelSupported() const override;
+    bool isCloseOnDoubleClickOnMenu() const override;
+    QVector<KDecoration2::DecorationButtonType> decorationButtonsLeft() const override;
+    QVector<KDecoration2::DecorationButtonType> decorationButtonsRight() const override;
+    KDecoration2::BorderSize borderSize() const override;
+
+private:
+    bool m_alphaChannelSupported;
+};
+
+/**
+ * Stands in for KWin. Decorations created with this bridge get a
+ * MockClient in the state of clientState and MockSettings.
+ */
+class MockBridge : public KDecoration2::DecorationBridge
+{
+public:
+    std::unique_ptr<KDecoration2::DecoratedClientPrivate> createClient(
+        KDecoration2::DecoratedClient *client,
+        KDecoration2::Decoration *decoration) override;
+    std::unique_ptr<KDecoration2::DecorationSettingsPrivate> settings(
+        KDecoration2::DecorationSettings *parent) override;
+
+    MockClientState clientState;
+    bool alphaChannelSupported = true;
+};
+
+} // namespace Material
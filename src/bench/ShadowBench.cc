@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2020 Chris Holland <zrenfire@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Renders every shadow radius the presets use with both
+ * BoxShadowHelper::boxShadow() and boxShadowReference(), at several
+ * device pixel ratios, and prints the largest difference of any channel.
+ * The reference is rendered with each blur kernel the CPU supports.
+ *
+ * It fails if a vector kernel doesn't match the scalar one exactly, or if
+ * boxShadow() differs from the reference by more than one level. It also
+ * prints the time either path takes per shadow, the reference once per
+ * kernel.
+ *
+ *   boxshadow_bench [--iterations N]
+ */
+
+// own
+#include "BoxShadowHelper.h"
+
+// Qt
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QGuiApplication>
+#include <QImage>
+#include <QPainter>
+#include <QTextStream>
+#include <QVector>
+
+// std
+#include <cstdlib>
+
+namespace Material
+{
+namespace
+{
+
+struct ShadowCase
+{
+    int radius;
+    QPoint offset;
+    qreal devicePixelRatio;
+};
+
+using BoxShadowFunc = void (*)(QPainter *, const QRect &, const QPoint &, int, const QColor &);
+
+// Same box as renderShadow() in Decoration.cc uses for a single shadow.
+QImage renderCase(const ShadowCase &shadowCase, BoxShadowFunc func)
+{
+    const int radius = shadowCase.radius;
+    const QRect box(QPoint(radius, radius), QSize(2 * radius + 1, 2 * radius + 1));
+    const QRect rect = box.adjusted(-radius, -radius, radius, radius);
+
+    QImage image(rect.size() * shadowCase.devicePixelRatio, QImage::Format_ARGB32_Premultiplied);
+    image.setDevicePixelRatio(shadowCase.devicePixelRatio);
+    image.fill(Qt::transparent);
+
+    QPainter painter(&image);
+    func(&painter, box, shadowCase.offset, radius, QColor(0, 0, 0, 255));
+    painter.end();
+
+    return image;
+}
+
+qint64 nsPerShadow(const ShadowCase &shadowCase, BoxShadowFunc func, int iterations)
+{
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < iterations; ++i) {
+        renderCase(shadowCase, func);
+    }
+    return timer.nsecsElapsed() / iterations;
+}
+
+int maxDifference(const QImage &a, const QImage &b)
+{
+    int difference = 0;
+    for (int y = 0; y < a.height(); ++y) {
+        const uchar *lineA = a.constScanLine(y);
+        const uchar *lineB = b.constScanLine(y);
+        for (int x = 0; x < a.bytesPerLine(); ++x) {
+            difference = qMax(difference, qAbs(lineA[x] - lineB[x]));
+        }
+    }
+    return difference;
+}
+
+struct KernelInfo
+{
+    BoxShadowHelper::BlurKernel kernel;
+    const char *name;
+};
+
+QVector<KernelInfo> supportedKernels()
+{
+    const QVector<KernelInfo> kernels = {
+        { BoxShadowHelper::BlurKernel::Scalar, "scalar" },
+        { BoxShadowHelper::BlurKernel::Sse2, "sse2" },
+        { BoxShadowHelper::BlurKernel::Avx2, "avx2" },
+    };
+
+    QVector<KernelInfo> supported;
+    for (const KernelInfo &info : kernels) {
+        if (BoxShadowHelper::setBlurKernel(info.kernel)) {
+            supported.append(info);
+        }
+    }
+    BoxShadowHelper::setBlurKernel(BoxShadowHelper::BlurKernel::Auto);
+
+    return supported;
+}
+
+QVector<ShadowCase> shadowCases()
+{
+    // The radii of both shadows of every preset in Decoration.cc.
+    const QVector<int> radii = { 8, 16, 24, 32, 48, 64 };
+    const QVector<qreal> ratios = { 1, 1.25, 1.5, 2 };
+
+    QVector<ShadowCase> cases;
+    for (const int radius : radii) {
+        for (const qreal ratio : ratios) {
+            cases.append({ radius, QPoint(0, 0), ratio });
+            cases.append({ radius, QPoint(0, -radius / 8), ratio });
+        }
+    }
+    return cases;
+}
+
+} // anonymous namespace
+} // namespace Material
+
+int main(int argc, char **argv)
+{
+    using namespace Material;
+
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+
+    QGuiApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption iterationsOption(QStringLiteral("iterations"),
+        QStringLiteral("Number of timed shadows per case and path."),
+        QStringLiteral("count"), QStringLiteral("20"));
+    parser.addOption(iterationsOption);
+    parser.process(app);
+
+    const int iterations = qMax(1, parser.value(iterationsOption).toInt());
+    const QVector<KernelInfo> kernels = supportedKernels();
+
+    QTextStream out(stdout);
+    out << "radius\toffset\tdpr\tkernel\tmax diff\tvs scalar\tns fast\tns reference\n";
+
+    int worst = 0;
+    int worstKernel = 0;
+    for (const ShadowCase &shadowCase : shadowCases()) {
+        const QImage fast = renderCase(shadowCase, BoxShadowHelper::boxShadow);
+        const qint64 fastNs = nsPerShadow(shadowCase, BoxShadowHelper::boxShadow, iterations);
+
+        QImage scalar;
+        for (const KernelInfo &info : kernels) {
+            BoxShadowHelper::setBlurKernel(info.kernel);
+            const QImage reference = renderCase(shadowCase, BoxShadowHelper::boxShadowReference);
+            if (scalar.isNull()) {
+                scalar = reference;
+            }
+
+            const int difference = maxDifference(fast, reference);
+            const int kernelDifference = maxDifference(scalar, reference);
+            worst = qMax(worst, difference);
+            worstKernel = qMax(worstKernel, kernelDifference);
+            const qint64 referenceNs = nsPerShadow(shadowCase, BoxShadowHelper::boxShadowReference, iterations);
+
+            out << shadowCase.radius << '\t'
+                << shadowCase.offset.y() << '\t'
+                << shadowCase.devicePixelRatio << '\t'
+                << info.name << '\t'
+                << difference << '\t'
+                << kernelDifference << '\t'
+                << fastNs << '\t'
+                << referenceNs << '\n';
+            out.flush();
+        }
+    }
+    BoxShadowHelper::setBlurKernel(BoxShadowHelper::BlurKernel::Auto);
+
+    return worst <= 1 && worstKernel == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
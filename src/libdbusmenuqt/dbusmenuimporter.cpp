@@ -35,7 +35,9 @@
 #include <QTimer>
 #include <QToolButton>
 #include <QWidgetAction>
+#include <QHash>
 #include <QSet>
+#include <QVector>
 #include <QDebug>
 
 // Local
@@ -59,6 +61,33 @@ static QTime sChrono;
 static const char *DBUSMENU_PROPERTY_ID = "_dbusmenu_id";
 static const char *DBUSMENU_PROPERTY_ICON_NAME = "_dbusmenu_icon_name";
 static const char *DBUSMENU_PROPERTY_ICON_DATA_HASH = "_dbusmenu_icon_data_hash";
+static const char *DBUSMENU_PROPERTY_LAYOUT_DEPTH = "_dbusmenu_layout_depth";
+static const char *DBUSMENU_PROPERTY_REQUESTED_PROPERTIES = "_dbusmenu_requested_properties";
+
+// Above this many items in one reply, deeper fetches cost more than the
+// round trips they save, so the importer goes back to one level at a time.
+static const int LARGE_LAYOUT_ITEM_COUNT = 500;
+
+class DBusMenuImporterPrivate;
+
+typedef void (DBusMenuImporterPrivate::*PropertyUpdater)(QAction *action, const QVariant &value);
+
+struct PropertyHandler
+{
+    QLatin1String key;
+    // Null for the properties which are only read by createAction()
+    PropertyUpdater update;
+};
+
+// Size of the property handler table, a power of two large enough for
+// propertyHash() to give every known property a slot of its own.
+static const int PROPERTY_HANDLER_SLOTS = 32;
+
+template<typename String>
+static int propertyHash(const String &key)
+{
+    return (key.size() + 7 * key.at(0).unicode() + key.at(key.size() - 1).unicode()) & (PROPERTY_HANDLER_SLOTS - 1);
+}
 
 static QAction *createKdeTitle(QAction *action, QWidget *parent)
 {
@@ -89,18 +118,89 @@ public:
 
     QSet<int> m_idsRefreshedByAboutToShow;
     QSet<int> m_pendingLayoutUpdates;
+    // Menus which got a LayoutUpdated since their last AboutToShow
+    QSet<int> m_layoutChangedIds;
+    // Revision of each menu as of its last GetLayout reply, and the newest
+    // revision the exporter announced or sent
+    QHash<int, uint> m_layoutRevisions;
+    uint m_revision;
+    // Menus whose AboutToShow call has not been answered yet
+    QSet<int> m_pendingAboutToShowIds;
+    // Menus whose last AboutToShow only refreshed their properties
+    QSet<int> m_idsRefreshedByProperties;
+    // Whether the exporter was seen announcing a layout change before
+    // replying to AboutToShow, and after replying
+    bool m_announcesLayoutEarly;
+    bool m_announcesLayoutLate;
+
+    int m_layoutDepth;
+    bool m_largeLayout;
 
     QDBusPendingCallWatcher *refresh(int id)
     {
-        auto call = m_interface->GetLayout(id, 1, QStringList());
+        m_layoutChangedIds.remove(id);
+        const int depth = m_largeLayout ? 1 : m_layoutDepth;
+        auto call = m_interface->GetLayout(id, depth, QStringList());
         QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(call, q);
         watcher->setProperty(DBUSMENU_PROPERTY_ID, id);
+        watcher->setProperty(DBUSMENU_PROPERTY_LAYOUT_DEPTH, depth);
         QObject::connect(watcher, &QDBusPendingCallWatcher::finished,
             q, &DBusMenuImporter::slotGetLayoutFinished);
 
         return watcher;
     }
 
+    /**
+     * Whether the layout of menu id is known to be current when its
+     * AboutToShow reply arrives, so that refreshProperties() is enough.
+     *
+     * This relies on the exporter announcing a layout change with
+     * LayoutUpdated, and a newer revision, before it replies to
+     * AboutToShow. Not all exporters do, so it is only assumed once the
+     * exporter was seen doing it, and never again once it announced a
+     * change after replying.
+     */
+    bool isLayoutCurrent(int id) const
+    {
+        return m_announcesLayoutEarly
+            && !m_announcesLayoutLate
+            && !m_layoutChangedIds.contains(id)
+            && m_layoutRevisions.contains(id)
+            && m_layoutRevisions.value(id) == m_revision;
+    }
+
+    /**
+     * Fetches only the properties a menu shows for the items of menu id,
+     * for when its layout is known to be current
+     */
+    QDBusPendingCallWatcher *refreshProperties(int id, QMenu *menu)
+    {
+        static const QStringList renderedProperties = {
+            QStringLiteral("label"),
+            QStringLiteral("enabled"),
+            QStringLiteral("visible"),
+            QStringLiteral("toggle-state"),
+            QStringLiteral("icon-name"),
+            QStringLiteral("shortcut"),
+        };
+
+        QList<int> ids;
+        const auto actions = menu->actions();
+        ids.reserve(actions.count());
+        for (QAction *action: actions) {
+            ids << action->property(DBUSMENU_PROPERTY_ID).toInt();
+        }
+
+        auto call = m_interface->GetGroupProperties(ids, renderedProperties);
+        QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(call, q);
+        watcher->setProperty(DBUSMENU_PROPERTY_ID, id);
+        watcher->setProperty(DBUSMENU_PROPERTY_REQUESTED_PROPERTIES, renderedProperties);
+        QObject::connect(watcher, &QDBusPendingCallWatcher::finished,
+            q, &DBusMenuImporter::slotGetGroupPropertiesFinished);
+
+        return watcher;
+    }
+
     QMenu *createMenu(QWidget *parent)
     {
         QMenu *menu = q->createMenu(parent);
@@ -141,7 +241,7 @@ public:
         }
 
         bool isKdeTitle = map.take(QStringLiteral("x-kde-title")).toBool();
-        updateAction(action, map, map.keys());
+        updateAction(action, map);
 
         if (isKdeTitle) {
             action = createKdeTitle(action, parent);
@@ -150,6 +250,20 @@ public:
         return action;
     }
 
+    /**
+     * Update the mutable properties of an action which are in map.
+     * Immutable ones, such as "type", are skipped.
+     */
+    void updateAction(QAction *action, const QVariantMap &map)
+    {
+        QVariantMap::ConstIterator
+            it = map.constBegin(),
+            end = map.constEnd();
+        for (; it != end; ++it) {
+            updateActionProperty(action, it.key(), it.value());
+        }
+    }
+
     /**
      * Update mutable properties of an action. A property may be listed in
      * requestedProperties but not in map, this means we should use the default value
@@ -168,23 +282,52 @@ public:
 
     void updateActionProperty(QAction *action, const QString &key, const QVariant &value)
     {
-        if (key == QLatin1String("label")) {
-            updateActionLabel(action, value);
-        } else if (key == QLatin1String("enabled")) {
-            updateActionEnabled(action, value);
-        } else if (key == QLatin1String("toggle-state")) {
-            updateActionChecked(action, value);
-        } else if (key == QLatin1String("icon-name")) {
-            updateActionIconByName(action, value);
-        } else if (key == QLatin1String("icon-data")) {
-            updateActionIconByData(action, value);
-        } else if (key == QLatin1String("visible")) {
-            updateActionVisible(action, value);
-        } else if (key == QLatin1String("shortcut")) {
-            updateActionShortcut(action, value);
-        } else {
+        const PropertyHandler *handler = propertyHandler(key);
+        if (!handler) {
             qDebug(DBUSMENUQT) << "Unhandled property update" << key;
+        } else if (handler->update) {
+            (this->*handler->update)(action, value);
+        }
+    }
+
+    /**
+     * Returns the handler of property key, or nullptr if the property is
+     * unknown. Properties arrive for every item on every update, so this
+     * costs one hash and at most one string comparison.
+     */
+    static const PropertyHandler *propertyHandler(const QString &key)
+    {
+        static const QVector<PropertyHandler> handlers = createPropertyHandlers();
+        if (key.isEmpty()) {
+            return nullptr;
         }
+        const PropertyHandler &handler = handlers.at(propertyHash(key));
+        return handler.key == key ? &handler : nullptr;
+    }
+
+    static QVector<PropertyHandler> createPropertyHandlers()
+    {
+        const PropertyHandler knownHandlers[] = {
+            { QLatin1String("label"), &DBusMenuImporterPrivate::updateActionLabel },
+            { QLatin1String("enabled"), &DBusMenuImporterPrivate::updateActionEnabled },
+            { QLatin1String("toggle-state"), &DBusMenuImporterPrivate::updateActionChecked },
+            { QLatin1String("icon-name"), &DBusMenuImporterPrivate::updateActionIconByName },
+            { QLatin1String("icon-data"), &DBusMenuImporterPrivate::updateActionIconByData },
+            { QLatin1String("visible"), &DBusMenuImporterPrivate::updateActionVisible },
+            { QLatin1String("shortcut"), &DBusMenuImporterPrivate::updateActionShortcut },
+            { QLatin1String("type"), nullptr },
+            { QLatin1String("toggle-type"), nullptr },
+            { QLatin1String("children-display"), nullptr },
+            { QLatin1String("x-kde-title"), nullptr },
+        };
+
+        QVector<PropertyHandler> handlers(PROPERTY_HANDLER_SLOTS);
+        for (const PropertyHandler &handler : knownHandlers) {
+            PropertyHandler &slot = handlers[propertyHash(handler.key)];
+            Q_ASSERT_X(slot.key.isEmpty(), "createPropertyHandlers", "two properties share a slot");
+            slot = handler;
+        }
+        return handlers;
     }
 
     void updateActionLabel(QAction *action, const QVariant &value)
@@ -252,6 +395,91 @@ public:
         action->setShortcut(keySequence);
     }
 
+    /**
+     * Syncs the actions of menu with the children of item, then does the same
+     * for each submenu whose children came with the same reply.
+     *
+     * @param depth how many levels below item the reply holds, -1 for all
+     */
+    void updateMenuFromLayout(QMenu *menu, const DBusMenuLayoutItem &item, int depth)
+    {
+        //remove outdated actions
+        QSet<int> newDBusMenuItemIds;
+        newDBusMenuItemIds.reserve(item.children.count());
+        for (const DBusMenuLayoutItem &child: item.children) {
+            newDBusMenuItemIds << child.id;
+        }
+        QList<QAction *> currentActions = menu->actions();
+        for (QAction *action: menu->actions()) {
+            int id = action->property(DBUSMENU_PROPERTY_ID).toInt();
+            if (! newDBusMenuItemIds.contains(id)) {
+                // Not calling removeAction() as QMenu will immediately close when it becomes empty,
+                // which can happen when an application completely reloads this menu.
+                // When the action is deleted deferred, it is removed from the menu.
+                action->deleteLater();
+                m_actionForId.remove(id);
+                currentActions.removeOne(action);
+            }
+        }
+
+        //create or update the actions, in the order of the dbus reply
+        QList<QAction *> orderedActions;
+        orderedActions.reserve(item.children.count());
+        for (const DBusMenuLayoutItem &dbusMenuItem: item.children) {
+            ActionForId::Iterator it = m_actionForId.find(dbusMenuItem.id);
+            QAction *action = nullptr;
+            if (it == m_actionForId.end()) {
+                int id = dbusMenuItem.id;
+                action = createAction(id, dbusMenuItem.properties, menu);
+                m_actionForId.insert(id, action);
+
+                QObject::connect(action, &QObject::destroyed, q, [this, id]() {
+                    m_actionForId.remove(id);
+                });
+
+                QObject::connect(action, &QAction::triggered, q, [ id, this]() {
+                    q->sendClickedEvent(id);
+                });
+
+                if (QMenu *menuAction = action->menu()) {
+                    QObject::connect(menuAction, &QMenu::aboutToShow, q, &DBusMenuImporter::slotMenuAboutToShow, Qt::UniqueConnection);
+                }
+                QObject::connect(menu, &QMenu::aboutToHide, q, &DBusMenuImporter::slotMenuAboutToHide, Qt::UniqueConnection);
+            } else {
+                action = *it;
+                updateAction(action, dbusMenuItem.properties);
+            }
+            orderedActions << action;
+        }
+
+        //insert the new actions
+        if (orderedActions.mid(0, currentActions.count()) == currentActions) {
+            // Usual case: nothing moved, so new actions only go at the tail
+            // and are added in one go.
+            menu->addActions(orderedActions.mid(currentActions.count()));
+        } else {
+            // Move each action to the tail so we can keep the order same as the dbus request.
+            for (QAction *action: orderedActions) {
+                menu->removeAction(action);
+                menu->addAction(action);
+            }
+        }
+
+        // Build the submenus from the same reply, before announcing the
+        // parent, so listeners see the whole subtree at once.
+        if (depth != 1) {
+            const int childDepth = depth < 0 ? depth : depth - 1;
+            for (const DBusMenuLayoutItem &child : item.children) {
+                QAction *action = m_actionForId.value(child.id);
+                if (action && action->menu()) {
+                    updateMenuFromLayout(action->menu(), child, childDepth);
+                }
+            }
+        }
+
+        emit q->menuUpdated(menu);
+    }
+
     QMenu *menuForId(int id) const
     {
         if (id == 0) {
@@ -273,14 +501,29 @@ public:
 };
 
 DBusMenuImporter::DBusMenuImporter(const QString &service, const QString &path, QObject *parent)
+: DBusMenuImporter(service, path, 1, parent)
+{
+}
+
+DBusMenuImporter::DBusMenuImporter(const QString &service, const QString &path, int layoutDepth, QObject *parent)
+: DBusMenuImporter(service, path, QDBusConnection::sessionBus(), layoutDepth, parent)
+{
+}
+
+DBusMenuImporter::DBusMenuImporter(const QString &service, const QString &path, const QDBusConnection &connection, int layoutDepth, QObject *parent)
 : QObject(parent)
 , d(new DBusMenuImporterPrivate)
 {
     DBusMenuTypes_register();
 
     d->q = this;
-    d->m_interface = new DBusMenuInterface(service, path, QDBusConnection::sessionBus(), this);
+    d->m_interface = new DBusMenuInterface(service, path, connection, this);
     d->m_menu = nullptr;
+    d->m_layoutDepth = layoutDepth;
+    d->m_largeLayout = false;
+    d->m_revision = 0;
+    d->m_announcesLayoutEarly = false;
+    d->m_announcesLayoutLate = false;
 
     d->m_pendingLayoutUpdateTimer = new QTimer(this);
     d->m_pendingLayoutUpdateTimer->setSingleShot(true);
@@ -304,9 +547,28 @@ DBusMenuImporter::~DBusMenuImporter()
     delete d;
 }
 
+void DBusMenuImporter::setLayoutDepth(int depth)
+{
+    d->m_layoutDepth = depth;
+}
+
+int DBusMenuImporter::layoutDepth() const
+{
+    return d->m_layoutDepth;
+}
+
 void DBusMenuImporter::slotLayoutUpdated(uint revision, int parentId)
 {
-    Q_UNUSED(revision)
+    d->m_revision = qMax(d->m_revision, revision);
+    if (d->m_pendingAboutToShowIds.contains(parentId)) {
+        d->m_announcesLayoutEarly = true;
+    }
+    if (d->m_idsRefreshedByProperties.remove(parentId)) {
+        qDebug(DBUSMENUQT) << "Layout announced after AboutToShow, always fetching layouts from now on";
+        d->m_announcesLayoutLate = true;
+    }
+
+    d->m_layoutChangedIds << parentId;
     if (d->m_idsRefreshedByAboutToShow.remove(parentId)) {
         return;
     }
@@ -342,12 +604,7 @@ void DBusMenuImporterPrivate::slotItemsPropertiesUpdated(const DBusMenuItemList
             continue;
         }
 
-        QVariantMap::ConstIterator
-            it = item.properties.constBegin(),
-            end = item.properties.constEnd();
-        for(; it != end; ++it) {
-            updateActionProperty(action, it.key(), it.value());
-        }
+        updateAction(action, item.properties);
     }
 
     Q_FOREACH(const DBusMenuItemKeys &item, removedList) {
@@ -378,6 +635,7 @@ void DBusMenuImporter::slotItemActivationRequested(int id, uint /*timestamp*/)
 void DBusMenuImporter::slotGetLayoutFinished(QDBusPendingCallWatcher *watcher)
 {
     int parentId = watcher->property(DBUSMENU_PROPERTY_ID).toInt();
+    int depth = watcher->property(DBUSMENU_PROPERTY_LAYOUT_DEPTH).toInt();
     watcher->deleteLater();
 
     QMenu *menu = d->menuForId(parentId);
@@ -395,66 +653,21 @@ void DBusMenuImporter::slotGetLayoutFinished(QDBusPendingCallWatcher *watcher)
     DMDEBUG << "- items received:" << sChrono.elapsed() << "ms";
     #endif
     DBusMenuLayoutItem rootItem = reply.argumentAt<1>();
+    const uint revision = reply.argumentAt<0>();
+    d->m_revision = qMax(d->m_revision, revision);
+    d->m_layoutRevisions.insert(parentId, revision);
 
     if (!menu) {
         qDebug(DBUSMENUQT) << "No menu for id" << parentId;
         return;
     }
 
-    //remove outdated actions
-    QSet<int> newDBusMenuItemIds;
-    newDBusMenuItemIds.reserve(rootItem.children.count());
-    for (const DBusMenuLayoutItem &item: rootItem.children) {
-        newDBusMenuItemIds << item.id;
-    }
-    for (QAction *action: menu->actions()) {
-        int id = action->property(DBUSMENU_PROPERTY_ID).toInt();
-        if (! newDBusMenuItemIds.contains(id)) {
-            // Not calling removeAction() as QMenu will immediately close when it becomes empty,
-            // which can happen when an application completely reloads this menu.
-            // When the action is deleted deferred, it is removed from the menu.
-            action->deleteLater();
-            d->m_actionForId.remove(id);
-        }
+    if (depth != 1 && !d->m_largeLayout && layoutItemCount(rootItem) > LARGE_LAYOUT_ITEM_COUNT) {
+        qDebug(DBUSMENUQT) << "Large menu, fetching one level at a time from now on";
+        d->m_largeLayout = true;
     }
 
-    //insert or update new actions into our menu
-    for (const DBusMenuLayoutItem &dbusMenuItem: rootItem.children) {
-        DBusMenuImporterPrivate::ActionForId::Iterator it = d->m_actionForId.find(dbusMenuItem.id);
-        QAction *action = nullptr;
-        if (it == d->m_actionForId.end()) {
-            int id = dbusMenuItem.id;
-            action = d->createAction(id, dbusMenuItem.properties, menu);
-            d->m_actionForId.insert(id, action);
-
-            connect(action, &QObject::destroyed, this, [this, id]() {
-                d->m_actionForId.remove(id);
-            });
-
-            connect(action, &QAction::triggered, this, [ id, this]() {
-                sendClickedEvent(id);
-            });
-
-            if (QMenu *menuAction = action->menu()) {
-                connect(menuAction, &QMenu::aboutToShow, this, &DBusMenuImporter::slotMenuAboutToShow, Qt::UniqueConnection);
-            }
-            connect(menu, &QMenu::aboutToHide, this, &DBusMenuImporter::slotMenuAboutToHide, Qt::UniqueConnection);
-
-            menu->addAction(action);
-        } else {
-            action = *it;
-            QStringList filteredKeys = dbusMenuItem.properties.keys();
-            filteredKeys.removeOne("type");
-            filteredKeys.removeOne("toggle-type");
-            filteredKeys.removeOne("children-display");
-            d->updateAction(*it, dbusMenuItem.properties, filteredKeys);
-            // Move the action to the tail so we can keep the order same as the dbus request.
-            menu->removeAction(action);
-            menu->addAction(action);
-        }
-    }
-
-    emit menuUpdated(menu);
+    d->updateMenuFromLayout(menu, rootItem, depth);
 }
 
 void DBusMenuImporter::sendClickedEvent(int id)
@@ -476,6 +689,8 @@ void DBusMenuImporter::updateMenu(QMenu * menu)
 
     int id = action->property(DBUSMENU_PROPERTY_ID).toInt();
 
+    d->m_layoutChangedIds.remove(id);
+    d->m_pendingAboutToShowIds << id;
     auto call = d->m_interface->AboutToShow(id);
     QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(call, this);
     watcher->setProperty(DBUSMENU_PROPERTY_ID, id);
@@ -490,6 +705,7 @@ void DBusMenuImporter::slotAboutToShowDBusCallFinished(QDBusPendingCallWatcher *
 {
     int id = watcher->property(DBUSMENU_PROPERTY_ID).toInt();
     watcher->deleteLater();
+    d->m_pendingAboutToShowIds.remove(id);
 
     QMenu *menu = d->menuForId(id);
     if (!menu) {
@@ -506,14 +722,50 @@ void DBusMenuImporter::slotAboutToShowDBusCallFinished(QDBusPendingCallWatcher *
     //this returns, which equates to the same thing
     bool needRefresh = reply.argumentAt<0>();
 
-    if (needRefresh || menu->actions().isEmpty()) {
+    if (menu->actions().isEmpty() || (needRefresh && !d->isLayoutCurrent(id))) {
         d->m_idsRefreshedByAboutToShow << id;
         d->refresh(id);
+    } else if (needRefresh) {
+        // The layout didn't change, so only labels, enabled states and the
+        // like can be out of date. Should the layout change after all, its
+        // LayoutUpdated signal still triggers a full refresh.
+        d->m_idsRefreshedByProperties << id;
+        d->refreshProperties(id, menu);
     } else if (menu) {
         menuUpdated(menu);
     }
 }
 
+void DBusMenuImporter::slotGetGroupPropertiesFinished(QDBusPendingCallWatcher *watcher)
+{
+    int id = watcher->property(DBUSMENU_PROPERTY_ID).toInt();
+    const QStringList requestedProperties = watcher->property(DBUSMENU_PROPERTY_REQUESTED_PROPERTIES).toStringList();
+    watcher->deleteLater();
+
+    QMenu *menu = d->menuForId(id);
+    if (!menu) {
+        return;
+    }
+
+    QDBusPendingReply<DBusMenuItemList> reply = *watcher;
+    if (reply.isError()) {
+        qDebug(DBUSMENUQT) << "Call to GetGroupProperties() failed:" << reply.error().message();
+        menuUpdated(menu);
+        return;
+    }
+
+    // Properties which are left out have their default value.
+    const DBusMenuItemList items = reply.argumentAt<0>();
+    for (const DBusMenuItem &item: items) {
+        QAction *action = d->m_actionForId.value(item.id);
+        if (action) {
+            d->updateAction(action, item.properties, requestedProperties);
+        }
+    }
+
+    menuUpdated(menu);
+}
+
 void DBusMenuImporter::slotMenuAboutToHide()
 {
     QMenu *menu = qobject_cast<QMenu*>(sender());
@@ -523,6 +775,7 @@ void DBusMenuImporter::slotMenuAboutToHide()
     Q_ASSERT(action);
 
     int id = action->property(DBUSMENU_PROPERTY_ID).toInt();
+    d->m_idsRefreshedByProperties.remove(id);
     d->sendEvent(id, QStringLiteral("closed"));
 }
 
@@ -25,6 +25,7 @@
 #include <QObject>
 
 class QAction;
+class QDBusConnection;
 class QDBusPendingCallWatcher;
 class QIcon;
 class QMenu;
@@ -44,8 +45,29 @@ public:
      */
     DBusMenuImporter(const QString &service, const QString &path, QObject *parent = nullptr);
 
+    /**
+     * Creates a DBusMenuImporter which fetches layoutDepth levels of the
+     * menu at once, see setLayoutDepth()
+     */
+    DBusMenuImporter(const QString &service, const QString &path, int layoutDepth, QObject *parent = nullptr);
+
+    /**
+     * Creates a DBusMenuImporter which talks to service over connection
+     * instead of the session bus
+     */
+    DBusMenuImporter(const QString &service, const QString &path, const QDBusConnection &connection, int layoutDepth, QObject *parent = nullptr);
+
     ~DBusMenuImporter() override;
 
+    /**
+     * How many levels of the menu a single GetLayout call fetches, 1 by
+     * default. -1 fetches the whole tree, so the submenus are built from
+     * the same reply as their parent. Menus which turn out to be very
+     * large are fetched one level at a time regardless.
+     */
+    void setLayoutDepth(int depth);
+    int layoutDepth() const;
+
 
     QAction *actionForId(int id) const;
 
@@ -99,6 +121,7 @@ private Q_SLOTS:
     void processPendingLayoutUpdates();
     void slotLayoutUpdated(uint revision, int parentId);
     void slotGetLayoutFinished(QDBusPendingCallWatcher *);
+    void slotGetGroupPropertiesFinished(QDBusPendingCallWatcher *);
 
 private:
     Q_DISABLE_COPY(DBusMenuImporter)
@@ -79,21 +79,32 @@ const QDBusArgument &operator>>(const QDBusArgument &argument, DBusMenuLayoutIte
 {
     argument.beginStructure();
     argument >> obj.id >> obj.properties;
+    obj.children.clear();
     argument.beginArray();
     while (!argument.atEnd()) {
         QDBusVariant dbusVariant;
         argument >> dbusVariant;
-        QDBusArgument childArgument = dbusVariant.variant().value<QDBusArgument>();
+        const QDBusArgument childArgument = qvariant_cast<QDBusArgument>(dbusVariant.variant());
 
-        DBusMenuLayoutItem child;
-        childArgument >> child;
-        obj.children.append(child);
+        // Decode the child in place: appending a decoded child would copy
+        // it, and the children list of every nested level with it.
+        obj.children.append(DBusMenuLayoutItem());
+        childArgument >> obj.children.last();
     }
     argument.endArray();
     argument.endStructure();
     return argument;
 }
 
+int layoutItemCount(const DBusMenuLayoutItem &item)
+{
+    int count = item.children.count();
+    for (const DBusMenuLayoutItem &child : item.children) {
+        count += layoutItemCount(child);
+    }
+    return count;
+}
+
 //// DBusMenuShortcut
 QDBusArgument &operator<<(QDBusArgument &argument, const DBusMenuShortcut &obj)
 {
@@ -85,6 +85,11 @@ Q_DECLARE_METATYPE(DBusMenuLayoutItem)
 QDBusArgument &operator<<(QDBusArgument &argument, const DBusMenuLayoutItem &);
 const QDBusArgument &operator>>(const QDBusArgument &argument, DBusMenuLayoutItem &);
 
+/**
+ * Returns the number of items below item, at any depth
+ */
+int layoutItemCount(const DBusMenuLayoutItem &item);
+
 typedef QList<DBusMenuLayoutItem> DBusMenuLayoutItemList;
 
 Q_DECLARE_METATYPE(DBusMenuLayoutItemList)